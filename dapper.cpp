@@ -1,30 +1,52 @@
 // Sockets code largely stolen from bspwm
 
 #include "rapidjson/document.h"
-#include "rapidjson/filereadstream.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <poll.h>
 #include <queue>
+#include <regex>
 #include <signal.h>
+#include <spawn.h>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 #include <functional>
 
 using namespace rapidjson;
 
 static const char *SOCKET_PATH = "/tmp/dapper.socket";
+static const char *SOCKET_ENV = "DAPPER_SOCKET";
 
-#define MAX(A, B) ((A) > (B) ? (A) : (B))
+// Clients send one command per line and can keep the connection open to
+// send more. Every command gets a reply, in order:
+//   <status> <payload length>\n<payload>
+// with status 0 on success. A last command without a newline still runs
+// when the client shuts down its end, which is all older clients do.
 
-static volatile bool running = false;
+#define MAX(A, B) ((A) > (B) ? (A) : (B))
 
 constexpr size_t BUF_SIZE = 10240;
 char buffer[BUF_SIZE];
@@ -34,486 +56,3460 @@ void err(const std::string& msg) {
   std::exit(1);
 }
 
-void execute(const char *cmd[]) {
-  setsid();
-  execvp(cmd[0], (char **) cmd);
+// Monotonic time in nanoseconds
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 +
+         static_cast<uint64_t>(ts.tv_nsec);
 }
 
-int spawn(const char *cmd[], bool sync) {
-  if (fork() == 0) {
-    if (sync) {
-      execute(cmd);
-    } else {
-      if (fork() == 0) {
-        execute(cmd);
-      }
-    }
-  }
+// Instrumentation. Every thread gets its own shard of counters and latency
+// histograms that only it writes to, so recording is a couple of relaxed
+// loads and stores. `dapperc stats` merges the shards.
+
+enum Counter {
+  SPAWNS,
+  EVENTS,
+  COMMANDS,
+  MOVES,
+  BSPWM_REQUESTS,
+  COALESCED_LAUNCHES,
+  TREE_RESYNCS,
+  COUNTER_COUNT
+};
 
-  int status;
-  wait(&status);
-  return WEXITSTATUS(status);
-}
+enum Op {
+  OP_COMMAND,     // handle_command
+  OP_EVENT,       // handle_event
+  OP_BSPWM,       // a bspwm round trip
+  OP_CLASSIFY,    // finding a window's class
+  OP_JSON_PARSE,  // parsing a bspwm reply
+  OP_COUNT
+};
 
-FILE *capture(const char *cmd[], const std::string& out = "") {
-  int in_pipe[2];
-  int out_pipe[2];
-  pipe(in_pipe);
-  pipe(out_pipe);
-
-  int pid = fork();
-  if (pid == 0) {
-    dup2(in_pipe[1], STDOUT_FILENO);
-    dup2(out_pipe[0], STDIN_FILENO);
-    close(in_pipe[0]);
-    close(out_pipe[1]);
+static const char *COUNTER_NAMES[] = {"spawns", "events", "commands", "moves",
+                                      "bspwm_requests", "coalesced_launches",
+                                      "tree_resyncs"};
+static const char *OP_NAMES[] = {"command", "event", "bspwm", "classify",
+                                 "json_parse"};
 
-    execvp(cmd[0], (char **) cmd);
-  }
+// Log-linear buckets in the style of HdrHistogram: values below 2^SUB_BITS
+// get their own bucket, above that each power of two is split into
+// 2^SUB_BITS buckets, so a bucket is never more than ~3% wide
+class Histogram {
+public:
+  static constexpr int SUB_BITS = 5;
+  static constexpr size_t SUB_COUNT = 1 << SUB_BITS;
+  static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
 
-  close(in_pipe[1]);
-  close(out_pipe[0]);
+  static size_t bucket(uint64_t value) {
+    if (value < SUB_COUNT) {
+      return static_cast<size_t>(value);
+    }
 
-  if (!out.empty()) {
-    write(out_pipe[1], out.c_str(), out.size());
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = static_cast<size_t>(value >> (msb - SUB_BITS)) & (SUB_COUNT - 1);
+    return static_cast<size_t>(msb - SUB_BITS + 1) * SUB_COUNT + sub;
   }
-  close(out_pipe[1]);
 
-  return fdopen(in_pipe[0], "r");
-}
+  // Smallest value that lands in the bucket
+  static uint64_t bucket_start(size_t index) {
+    size_t group = index / SUB_COUNT;
+    uint64_t sub = index % SUB_COUNT;
+    if (group == 0) {
+      return sub;
+    }
+    return (SUB_COUNT + sub) << (group - 1);
+  }
 
-Document json_from_file(FILE *file) {
-  FileReadStream is(file, buffer, BUF_SIZE);
+  void record(uint64_t value) {
+    auto &count = m_counts[bucket(value)];
+    count.store(count.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+  }
 
-  Document d;
-  d.ParseStream(is);
+  void merge_into(std::vector<uint64_t> &counts) const {
+    for (size_t i = 0; i < BUCKETS; i++) {
+      counts[i] += m_counts[i].load(std::memory_order_relaxed);
+    }
+  }
 
-  fclose(file);
-  return d;
-}
+private:
+  std::atomic<uint64_t> m_counts[BUCKETS] = {};
+};
 
-Document capture_cmd_json(const char *cmd[]) {
-  return json_from_file(capture(cmd));
-}
+class Stats {
+private:
+  struct Shard {
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    Histogram ops[OP_COUNT];
+  };
 
-std::vector<std::string> capture_cmd_lines(const char *cmd[],
-                                           const std::string &out = "") {
-  // TODO support writing to stdout
-  FILE *file = capture(cmd, out);
-  std::vector<std::string> lines;
+  // Shards outlive their threads so nothing recorded is lost
+  static std::mutex &shards_mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
 
-  while (!feof(file)) {
-    fgets(buffer, BUF_SIZE, file);
-    lines.emplace_back(buffer);
+  static std::vector<std::unique_ptr<Shard>> &shards() {
+    static std::vector<std::unique_ptr<Shard>> all;
+    return all;
   }
 
-  fclose(file);
-  return lines;
-}
+  static Shard &local() {
+    thread_local Shard *shard = [] {
+      std::lock_guard<std::mutex> lock(shards_mutex());
+      shards().push_back(std::make_unique<Shard>());
+      return shards().back().get();
+    }();
+    return *shard;
+  }
 
-Document parse_config() {
-  std::string target_path =
-      std::string(getenv("HOME")) + "/.config/dapper/config.json";
-  FILE *file = fopen(target_path.c_str(), "r");
-  if (!file) {
-    err("Could not read config file at: " + target_path);
+public:
+  static void count(Counter counter, uint64_t n = 1) {
+    auto &value = local().counters[counter];
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
   }
 
-  return json_from_file(file);
-}
+  static void record(Op op, uint64_t ns) {
+    local().ops[op].record(ns);
+  }
 
-std::vector<std::string> split_string(const std::string &str, char delim) {
-  std::stringstream stream(str);
-  std::string word;
-  std::vector<std::string> words;
+  // One line per counter, then one per operation with its latencies
+  static std::string report() {
+    std::lock_guard<std::mutex> lock(shards_mutex());
+    std::ostringstream out;
 
-  while (std::getline(stream, word, delim)) {
-    words.push_back(word);
-  }
+    for (int c = 0; c < COUNTER_COUNT; c++) {
+      uint64_t total = 0;
+      for (auto &shard : shards()) {
+        total += shard->counters[c].load(std::memory_order_relaxed);
+      }
+      out << COUNTER_NAMES[c] << ' ' << total << '\n';
+    }
 
-  return words;
-}
+    std::vector<uint64_t> counts(Histogram::BUCKETS);
+    for (int op = 0; op < OP_COUNT; op++) {
+      std::fill(counts.begin(), counts.end(), 0);
+      for (auto &shard : shards()) {
+        shard->ops[op].merge_into(counts);
+      }
 
-struct App {
-  std::vector<std::string> commands;
-  std::vector<std::string> classes;
+      uint64_t total = 0;
+      for (uint64_t count : counts) {
+        total += count;
+      }
+
+      out << OP_NAMES[op] << " n=" << total;
+      if (total == 0) {
+        out << '\n';
+        continue;
+      }
+
+      // Percentiles are reported as the start of their bucket, in us
+      const std::pair<const char *, double> percentiles[] = {
+          {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999},
+          {"max", 1.0}};
+      for (auto &pct : percentiles) {
+        auto rank = static_cast<uint64_t>(pct.second * (total - 1)) + 1;
+        uint64_t seen = 0;
+        size_t i = 0;
+        while (i + 1 < counts.size() && (seen += counts[i]) < rank) {
+          i++;
+        }
+        out << ' ' << pct.first << '=' << Histogram::bucket_start(i) / 1000.0
+            << "us";
+      }
+      out << '\n';
+    }
+
+    return out.str();
+  }
 };
-typedef std::shared_ptr<App> AppPtr;
 
-struct Config {
-  std::unordered_map<std::string, AppPtr> apps;
-  std::string launcher;
+// Records how long its scope took
+class ScopedTimer {
+private:
+  Op m_op;
+  uint64_t m_start;
+
+public:
+  explicit ScopedTimer(Op op) : m_op(op), m_start(now_ns()) {}
+  ~ScopedTimer() { Stats::record(m_op, now_ns() - m_start); }
 };
 
-class Dapper {
+// Child processes. Spawned with posix_spawn so launching doesn't depend on
+// our RSS, and reaped by pid on SIGCHLD so exit statuses aren't mixed up.
+
+class Processes {
 private:
-  std::string m_shell;
-  Config m_config;
+  typedef std::function<void(int)> ExitHandler;
 
-  std::string m_spare_desk; // where to move windows when we need to
+  posix_spawnattr_t m_attr;
+  std::unordered_map<pid_t, ExitHandler> m_children; // pid -> exit handler
+  bool m_dry_run;
 
-  std::unordered_map<std::string, std::string> m_class_app_map; // class -> app
-  std::unordered_map<std::string, std::unordered_set<int>>
-      m_app_windows;                                  // app -> window ids
-  std::unordered_map<int, std::string> m_window_apps; // window id -> app
+  pid_t spawn_with(const char *cmd[],
+                   const posix_spawn_file_actions_t *actions,
+                   ExitHandler on_exit) {
+    if (m_dry_run) {
+      return actions ? -1 : 0;
+    }
 
-  int spawn_shell(const std::string &shell_cmd) {
-    const char *cmd[] = {m_shell.c_str(), "-c", shell_cmd.c_str(), nullptr};
-    return spawn(cmd, false);
-  }
+    pid_t pid;
+    if (posix_spawnp(&pid, cmd[0], actions, &m_attr, (char *const *) cmd,
+                     environ) != 0) {
+      return -1;
+    }
 
-  int make_desk(const std::string &name) {
-    const char *cmd[] = {"bspc", "monitor", "--add-desktops", name.c_str(),
-                         nullptr};
-    return spawn(cmd, true);
+    Stats::count(SPAWNS);
+    m_children[pid] = std::move(on_exit);
+    return pid;
   }
 
-  int remove_desk(const std::string &name) {
-    const char *cmd[] = {"bspc", "desktop", name.c_str(), "--remove", nullptr};
-    return spawn(cmd, true);
-  }
+public:
+  // A dry run doesn't start anything, spawn() returns 0 and capture() fails
+  explicit Processes(bool dry_run = false) : m_dry_run(dry_run) {
+    // Children get a clean signal state and their own session, so apps
+    // aren't tied to the daemon's lifetime
+    sigset_t no_signals, default_signals;
+    sigemptyset(&no_signals);
+    sigemptyset(&default_signals);
+    for (int sig : {SIGCHLD, SIGPIPE, SIGINT, SIGHUP, SIGTERM}) {
+      sigaddset(&default_signals, sig);
+    }
 
-  int focus_desk(const std::string &name) {
-    const char *cmd[] = {"bspc", "desktop", name.c_str(), "--focus", nullptr};
-    return spawn(cmd, true);
+    posix_spawnattr_init(&m_attr);
+    posix_spawnattr_setsigmask(&m_attr, &no_signals);
+    posix_spawnattr_setsigdefault(&m_attr, &default_signals);
+    posix_spawnattr_setflags(&m_attr, POSIX_SPAWN_SETSIGMASK |
+                                          POSIX_SPAWN_SETSIGDEF |
+                                          POSIX_SPAWN_SETSID);
   }
 
-  int move_window(int wid, const std::string &desk) {
-    auto wid_str = std::to_string(wid);
-    const char *cmd[] = {
-        "bspc", "node", wid_str.c_str(),
-        "--to-desktop", desk.c_str(), nullptr};
-    return spawn(cmd, true);
+  ~Processes() {
+    posix_spawnattr_destroy(&m_attr);
   }
 
-  Document monitor_json() {
-    const char *cmd[] = {"bspc", "query", "-m", "-T", nullptr};
-    return capture_cmd_json(cmd);
+  // Returns the child's pid, or -1 if it couldn't be started. on_exit gets
+  // the exit status once the child has been reaped.
+  pid_t spawn(const char *cmd[], ExitHandler on_exit = nullptr) {
+    return spawn_with(cmd, nullptr, std::move(on_exit));
   }
 
-  std::string find_spare_desk() {
-    for (auto &desk : monitor_json()["desktops"].GetArray()) {
-      std::string name = desk["name"].GetString();
-      if (m_config.apps.find(name) == m_config.apps.end()) {
-        return name;
-      }
+  // Runs cmd with `out` on its stdin and returns the read end of its stdout,
+  // or -1. The child is reaped like any other.
+  int capture(const char *cmd[], pid_t &pid, const std::string &out = "",
+              ExitHandler on_exit = nullptr) {
+    int in_pipe[2];
+    int out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) == -1) {
+      return -1;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) == -1) {
+      close(in_pipe[0]);
+      close(in_pipe[1]);
+      return -1;
     }
 
-    std::string spare_name = "spare";
-    make_desk(spare_name);
-    return spare_name;
-  }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[0], STDIN_FILENO);
 
-  std::string desk_name_of_id(const std::string &desk_id) {
-    const char *desk_name_cmd[] = {"bspc", "query", "-d", desk_id.c_str(),
-                                   "-D", "--names", nullptr};
-    auto lines = capture_cmd_lines(desk_name_cmd);
-    return lines[0];
-  }
+    pid = spawn_with(cmd, &actions, std::move(on_exit));
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(in_pipe[1]);
+    close(out_pipe[0]);
+
+    if (pid != -1 && !out.empty()) {
+      write(out_pipe[1], out.c_str(), out.size());
+    }
+    close(out_pipe[1]);
 
-  int wid_of_string(const std::string &str) {
-    return std::stoi(str, nullptr, 16);
+    if (pid == -1) {
+      close(in_pipe[0]);
+      return -1;
+    }
+    return in_pipe[0];
   }
 
-  void handle_window(int wid, int desk_id) {
-    // Determine if window needs moving. If it's an app window it does, if
-    // it's a non-app window and it's on an app desktop, it also does.
+  // Call on SIGCHLD
+  void reap() {
+    // Signals coalesce, so collect every child that has exited
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      auto child_it = m_children.find(pid);
+      if (child_it == m_children.end()) {
+        continue;
+      }
 
-    // Find window class
-    auto wid_str = std::to_string(wid);
-    const char *node_cmd[] = {"bspc", "query", "-n",
-                              wid_str.c_str(), "-T", nullptr};
-    auto node_json = capture_cmd_json(node_cmd);
-    std::string cls = node_json["client"]["className"].GetString();
+      auto on_exit = std::move(child_it->second);
+      m_children.erase(child_it);
+      if (on_exit) {
+        // Like a shell, a child killed by a signal gets 128 + the signal
+        on_exit(WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                    : WEXITSTATUS(status));
+      }
+    }
+  }
+};
 
-    auto cls_it = m_class_app_map.find(cls);
-    if (cls_it != m_class_app_map.end()) {
-      // This is a valid app window!
-      std::string &app = cls_it->second;
+// Main loop: epoll over fds, with signals and timers delivered through a
+// signalfd and a timerfd so everything is handled in one place
 
-      m_app_windows[app].emplace(wid);
-      m_window_apps[wid] = app;
+class EventLoop {
+public:
+  typedef std::function<void(uint32_t)> FdHandler; // gets the epoll events
+  typedef std::function<void()> Callback;
+  typedef uint64_t TimerId;
 
-    } else {
-      // Not an app window, move to other desktop if on app desktop
-      std::string desk_name = desk_name_of_id(std::to_string(desk_id));
-      if (m_config.apps.find(desk_name) != m_config.apps.end()) {
-        move_window(wid, m_spare_desk);
-      }
+private:
+  int m_epoll_fd;
+  int m_signal_fd;
+  int m_timer_fd;
+  bool m_running = false;
+
+  sigset_t m_signals;
+  std::unordered_map<int, Callback> m_signal_handlers; // signal -> handler
+
+  // Shared so a handler can remove its own fd while it runs
+  std::unordered_map<int, std::shared_ptr<FdHandler>> m_fd_handlers;
+
+  // Timers live in a min-heap of deadlines, cancelled ones are skipped
+  typedef std::pair<uint64_t, TimerId> Deadline;
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>>
+      m_deadlines;
+  std::unordered_map<TimerId, Callback> m_timers;
+  TimerId m_next_timer = 1;
+
+  void epoll_add(int fd, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      err("Failed to add a descriptor to epoll");
     }
   }
 
-  typedef std::vector<std::pair<int, int>> win_desk_list;
+  void arm_timer() {
+    struct itimerspec spec = {};
+    if (!m_deadlines.empty()) {
+      // A zero it_value would disarm the timer
+      uint64_t deadline = MAX(m_deadlines.top().first, (uint64_t) 1);
+      spec.it_value.tv_sec = static_cast<time_t>(deadline / 1000000000);
+      spec.it_value.tv_nsec = static_cast<long>(deadline % 1000000000);
+    }
+    timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+  }
 
-  void desk_windows(int desk_id, const Value& node_val, win_desk_list& result) {
-    if (node_val["firstChild"].IsNull()) {
-      result.emplace_back(node_val["id"].GetInt(), desk_id);
-      return;
-    } else {
-      desk_windows(desk_id, node_val["firstChild"], result);
-      desk_windows(desk_id, node_val["secondChild"], result);
+  void handle_signals() {
+    struct signalfd_siginfo info;
+    while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+      auto handler_it = m_signal_handlers.find(static_cast<int>(info.ssi_signo));
+      if (handler_it != m_signal_handlers.end()) {
+        handler_it->second();
+      }
     }
-  };
+  }
 
-  win_desk_list current_windows() {
-    win_desk_list result;
-    auto json = monitor_json();
+  void handle_timers() {
+    uint64_t expirations;
+    read(m_timer_fd, &expirations, sizeof(expirations));
 
-    // get all windows and desktops
-    for (auto &desk_val : json["desktops"].GetArray()) {
-      int desk_id = desk_val["id"].GetInt();
-      auto &root_node = desk_val["root"];
-      if (!root_node.IsNull()) {
-        desk_windows(desk_id, root_node, result);
+    uint64_t now_ns = now();
+    while (!m_deadlines.empty() && m_deadlines.top().first <= now_ns) {
+      TimerId id = m_deadlines.top().second;
+      m_deadlines.pop();
+
+      auto timer_it = m_timers.find(id);
+      if (timer_it != m_timers.end()) {
+        auto callback = std::move(timer_it->second);
+        m_timers.erase(timer_it);
+        callback();
       }
     }
 
-    return result;
+    arm_timer();
   }
 
 public:
-  Dapper() {
-    // Determine an appropriate shell
-    m_shell = getenv("SHELL");
-    if (m_shell.empty()) {
-      m_shell = "sh";
+  EventLoop() {
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd == -1) {
+      err("Failed to create the epoll instance");
     }
 
-    // Read config
-    auto config = parse_config();
-    auto& app_config = config["apps"];
+    sigemptyset(&m_signals);
+    m_signal_fd = signalfd(-1, &m_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_signal_fd == -1 || m_timer_fd == -1) {
+      err("Failed to create the signal and timer descriptors");
+    }
 
-    for (auto &entry : app_config.GetObject()) {
-      std::vector<std::string> commands;
-      for (auto &cmd : entry.value["commands"].GetArray()) {
-        commands.emplace_back(cmd.GetString());
-      }
+    epoll_add(m_signal_fd, EPOLLIN);
+    epoll_add(m_timer_fd, EPOLLIN);
+  }
 
-      std::vector<std::string> classes;
-      for (auto &cls : entry.value["classes"].GetArray()) {
-        classes.emplace_back(cls.GetString());
-      }
+  ~EventLoop() {
+    close(m_timer_fd);
+    close(m_signal_fd);
+    close(m_epoll_fd);
+  }
+
+  // Monotonic time in nanoseconds
+  static uint64_t now() {
+    return now_ns();
+  }
+
+  void add(int fd, uint32_t events, FdHandler handler) {
+    m_fd_handlers[fd] = std::make_shared<FdHandler>(std::move(handler));
+    epoll_add(fd, events);
+  }
+
+  void modify(int fd, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  // Doesn't close the fd
+  void remove(int fd) {
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    m_fd_handlers.erase(fd);
+  }
+
+  // The signal is blocked and delivered through the loop from now on
+  void on_signal(int sig, Callback handler) {
+    m_signal_handlers[sig] = std::move(handler);
+
+    sigaddset(&m_signals, sig);
+    sigprocmask(SIG_BLOCK, &m_signals, nullptr);
+    signalfd(m_signal_fd, &m_signals, 0);
+  }
 
-      auto app = std::make_shared<App>();
-      app->commands = commands;
-      app->classes = classes;
-      m_config.apps[entry.name.GetString()] = app;
+  // Runs callback from the loop after delay_ms milliseconds
+  TimerId defer(uint64_t delay_ms, Callback callback) {
+    TimerId id = m_next_timer++;
+    m_timers[id] = std::move(callback);
+
+    uint64_t deadline = now() + delay_ms * 1000000;
+    bool earliest = m_deadlines.empty() || deadline < m_deadlines.top().first;
+    m_deadlines.emplace(deadline, id);
+    if (earliest) {
+      arm_timer();
     }
+    return id;
+  }
 
-    m_config.launcher = config["launcher"].GetString();
+  void cancel(TimerId id) {
+    m_timers.erase(id);
+  }
 
-    // Determine a spare desktop to move windows to if needed
-    m_spare_desk = find_spare_desk();
+  void run() {
+    constexpr int MAX_EVENTS = 64;
+    struct epoll_event events[MAX_EVENTS];
 
-    // Build class -> app map
-    // Build app -> windows map
-    // Build window -> app map
-    for (auto &app : m_config.apps) {
-      m_app_windows[app.first] = {};
-      for (auto &cls : app.second->classes) {
-        m_class_app_map[cls] = app.first;
+    m_running = true;
+    while (m_running) {
+      int n = epoll_wait(m_epoll_fd, events, MAX_EVENTS, -1);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        err("epoll_wait failed");
       }
-    }
 
-    // Create desktops for all the apps
-    for (auto &app : m_config.apps) {
-      make_desk(app.first);
+      for (int i = 0; i < n && m_running; i++) {
+        int fd = events[i].data.fd;
+        if (fd == m_signal_fd) {
+          handle_signals();
+        } else if (fd == m_timer_fd) {
+          handle_timers();
+        } else {
+          auto handler_it = m_fd_handlers.find(fd);
+          if (handler_it != m_fd_handlers.end()) {
+            auto handler = handler_it->second;
+            (*handler)(events[i].events);
+          }
+        }
+      }
     }
+  }
 
-    // Process all existing windows like they were newly opened
-    for (auto& wid_desk_id : current_windows()) {
-      handle_window(wid_desk_id.first, wid_desk_id.second);
-    }
+  void stop() {
+    m_running = false;
   }
+};
 
-  ~Dapper() {
-    for (auto &app : m_config.apps) {
-      remove_desk(app.first);
+// Reads the rest of the file and closes it
+std::string read_file(FILE *file) {
+  std::string text;
+  size_t n;
+  while ((n = fread(buffer, 1, BUF_SIZE, file)) > 0) {
+    text.append(buffer, n);
+  }
+
+  fclose(file);
+  return text;
+}
+
+std::string config_path() {
+  return std::string(getenv("HOME")) + "/.config/dapper/config.json";
+}
+
+// Compact binary log of everything that drives dapper, so a session can be
+// replayed without bspwm. After the magic, each record is a type byte, the
+// nanoseconds since the previous record and the payload length (both
+// varints), then the payload. Replies carry the request message first,
+// prefixed with its varint length. The config in use is logged at the start
+// and after every reload.
+
+class EventLog {
+public:
+  enum Type : uint8_t { EVENTS = 1, COMMAND = 2, REPLY = 3, CONFIG = 4 };
+
+  struct Record {
+    Type type;
+    uint64_t time; // ns since the log started
+    std::string data;
+  };
+
+private:
+  static constexpr const char *MAGIC = "DAPLOG1\n";
+  static constexpr size_t MAGIC_LEN = 8;
+
+  FILE *m_file = nullptr;
+  uint64_t m_start = 0;
+  uint64_t m_last = 0;
+
+  void put_varint(uint64_t value) {
+    while (value >= 0x80) {
+      fputc(static_cast<int>((value & 0x7F) | 0x80), m_file);
+      value >>= 7;
     }
+    fputc(static_cast<int>(value), m_file);
   }
 
-  void handle_command(const std::string &command) {
-    auto words = split_string(command, ' ');
-    if (words.empty()) {
-      return;
+  bool get_varint(uint64_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      int c = fgetc(m_file);
+      if (c == EOF) {
+        return false;
+      }
+      value |= static_cast<uint64_t>(c & 0x7F) << shift;
+      if (!(c & 0x80)) {
+        return true;
+      }
     }
+    return false;
+  }
+
+  void put_header(Type type, size_t len) {
+    uint64_t now = EventLoop::now() - m_start;
+    fputc(type, m_file);
+    put_varint(now - m_last);
+    put_varint(len);
+    m_last = now;
+  }
 
-    auto &app = words[0];
-    bool pull = words.size() > 1 && words[1] == "--pull";
+public:
+  EventLog() = default;
+  EventLog(const EventLog &) = delete;
+  EventLog &operator=(const EventLog &) = delete;
 
-    // TODO remove
-    for (auto& word : words) {
-      std::cout << word << ' ';
+  ~EventLog() {
+    if (m_file) {
+      fclose(m_file);
     }
-    std::cout << std::endl;
+  }
 
-    if (m_config.apps.find(app) == m_config.apps.end()) {
-      return;
+  bool open_write(const char *path) {
+    m_file = fopen(path, "wb");
+    if (!m_file) {
+      return false;
     }
+    fwrite(MAGIC, 1, MAGIC_LEN, m_file);
+    m_start = EventLoop::now();
+    return true;
+  }
 
-    const std::string &target_desk = pull ? "focused" : app;
+  bool open_read(const char *path) {
+    m_file = fopen(path, "rb");
+    char magic[MAGIC_LEN];
+    return m_file && fread(magic, 1, MAGIC_LEN, m_file) == MAGIC_LEN &&
+           std::memcmp(magic, MAGIC, MAGIC_LEN) == 0;
+  }
 
-    if (!m_app_windows[app].empty()) {
-      for (int wid : m_app_windows[app]) {
-        move_window(wid, target_desk);
-      }
-      if (!pull) {
-        focus_desk(app);
-      }
+  void write(Type type, const char *data, size_t len) {
+    put_header(type, len);
+    fwrite(data, 1, len, m_file);
+  }
 
-    } else {
-      // Try to open app
+  // Gets buffered records to disk, e.g. before an exec throws them away
+  void flush() {
+    if (m_file) {
+      fflush(m_file);
+    }
+  }
 
-      if (!pull) {
-        focus_desk(app);
-      }
+  void write_reply(const std::string &msg, const std::string &rsp) {
+    size_t msg_len_size = 1;
+    for (uint64_t len = msg.size(); len >= 0x80; len >>= 7) {
+      msg_len_size++;
+    }
 
-      auto &commands = m_config.apps[app]->commands;
-      if (commands.size() == 1) {
-        spawn_shell(commands[0]);
+    put_header(REPLY, msg_len_size + msg.size() + rsp.size());
+    put_varint(msg.size());
+    fwrite(msg.data(), 1, msg.size(), m_file);
+    fwrite(rsp.data(), 1, rsp.size(), m_file);
+  }
 
-      } else {
-        std::stringstream commands_combined;
-        for (auto &cmd : commands) {
-          commands_combined << cmd;
-        }
+  bool read(Record &record) {
+    int type = fgetc(m_file);
+    uint64_t delta, len;
+    if (type == EOF || !get_varint(delta) || !get_varint(len)) {
+      return false;
+    }
 
-        const char *launcher_cmd[] = {m_config.launcher.c_str(), nullptr};
-        auto lines = capture_cmd_lines(launcher_cmd, commands_combined.str());
+    record.type = static_cast<Type>(type);
+    record.time = m_last += delta;
+    record.data.resize(len);
+    return fread(&record.data[0], 1, len, m_file) == len;
+  }
 
-        if (!lines.empty()) {
-          spawn_shell(lines[0]);
-        }
+  // Splits a REPLY record's payload into the request message and the reply
+  static void split_reply(const std::string &data, std::string &msg,
+                          std::string &rsp) {
+    uint64_t msg_len = 0;
+    size_t i = 0;
+    for (int shift = 0; i < data.size(); shift += 7) {
+      auto c = static_cast<uint8_t>(data[i++]);
+      msg_len |= static_cast<uint64_t>(c & 0x7F) << shift;
+      if (!(c & 0x80)) {
+        break;
       }
     }
+
+    msg = data.substr(i, msg_len);
+    rsp = data.substr(std::min(data.size(), i + msg_len));
   }
+};
 
-  void handle_events(const std::string &events) {
-    for (auto &line : split_string(events, '\n')) {
-      auto words = split_string(line, ' ');
-      if (words.empty()) {
-        continue;
-      }
+// bspwm IPC, mirrors what bspc does but without the fork and exec
 
-      if (words[0] == "node_add") {
-        auto &desk_id_str = words[2];
-        auto &node_id_str = words[4];
-        int wid = wid_of_string(node_id_str);
-        int desk_id = wid_of_string(desk_id_str);
-        handle_window(wid, desk_id);
+static const char *BSPWM_SOCKET_ENV = "BSPWM_SOCKET";
+static const char *BSPWM_SOCKET_TPL = "/tmp/bspwm%s_%i_%i-socket";
+static const char BSPWM_FAILURE = 0x07;
 
-      } else if (words[0] == "node_remove") {
-        auto &node_id = words[3];
-        int wid = wid_of_string(node_id);
+// Same scheme as xcb_parse_display(): [protocol/]host:display[.screen]
+bool parse_display(const char *name, std::string &host, int &display,
+                   int &screen) {
+  if (!name || !*name) {
+    return false;
+  }
 
-        auto wapp_it = m_window_apps.find(wid);
-        if (wapp_it != m_window_apps.end()) {
-          auto &app = wapp_it->second;
-          m_app_windows[app].erase(wid);
+  std::string str(name);
+  auto slash = str.rfind('/');
+  if (slash != std::string::npos) {
+    str = str.substr(slash + 1);
+  }
 
-          m_window_apps.erase(wapp_it);
-        }
+  auto colon = str.rfind(':');
+  if (colon == std::string::npos) {
+    return false;
+  }
 
-      } else if (words[0] == "desktop_remove") {
-        auto &desk_id = words[2];
-        std::string desk_name = desk_name_of_id(desk_id);
+  host = str.substr(0, colon);
+  char *end;
+  const char *num = str.c_str() + colon + 1;
+  display = static_cast<int>(std::strtol(num, &end, 10));
+  if (end == num) {
+    return false;
+  }
 
-        if (desk_name == m_spare_desk) {
-          m_spare_desk = find_spare_desk();
-        }
+  screen = *end == '.' ? static_cast<int>(std::strtol(end + 1, nullptr, 10)) : 0;
+  return true;
+}
+
+class Bspwm {
+private:
+  // bspwm answers one connection at a time, but keeping several open lets
+  // it work through them without waiting on us in between
+  static constexpr size_t MAX_IN_FLIGHT = 32;
+
+  struct sockaddr_un m_address = {};
+  std::string m_msg;
+  std::string m_rsp;
+
+  // Every exchange is written to m_log when recording. When replaying,
+  // replies come from m_replay instead of the socket.
+  EventLog *m_log = nullptr;
+  bool m_replaying = false;
+  std::deque<std::pair<std::string, std::string>> m_replay; // msg, reply
+  long m_replay_misses = 0;
+
+  // Returns whether the reply came from the replay log
+  bool replay(const std::string &msg, std::string &rsp) {
+    if (!m_replaying) {
+      return false;
+    }
+
+    // Batched replies are logged in the order they complete, so look a
+    // little further than the front
+    size_t window = std::min(m_replay.size(), 2 * MAX_IN_FLIGHT);
+    for (size_t i = 0; i < window; i++) {
+      if (m_replay[i].first == msg) {
+        rsp = std::move(m_replay[i].second);
+        m_replay.erase(m_replay.begin() + static_cast<long>(i));
+        return true;
       }
     }
+
+    m_replay_misses++;
+    return true;
   }
-};
 
-void sig_handler(int sig) {
-  if (sig == SIGINT || sig == SIGHUP || sig == SIGTERM) {
-    running = false;
+  int connect_socket() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+      return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &m_address, sizeof(m_address)) == -1) {
+      close(fd);
+      return -1;
+    }
+
+    return fd;
   }
-}
 
-int main() {
-  // Create file descriptor for `bspc subscribe` process's stdout
+  // Arguments are sent NUL-terminated back to back, like bspc does
+  static void encode(const char *args[], std::string &msg) {
+    msg.clear();
+    for (int i = 0; args[i]; i++) {
+      msg.append(args[i]);
+      msg.push_back('\0');
+    }
+  }
+
+  int send_message(const std::string &msg) {
+    int fd = connect_socket();
+    if (fd == -1) {
+      std::cerr << "Failed to connect to the bspwm socket" << std::endl;
+      return -1;
+    }
+
+    if (send(fd, msg.data(), msg.size(), 0) == -1) {
+      std::cerr << "Failed to send the data to bspwm" << std::endl;
+      close(fd);
+      return -1;
+    }
+
+    return fd;
+  }
 
-  int pipe_fds[2];
-  if (pipe(pipe_fds) == -1) {
-    err("Failed to create pipe");
+  static int check_reply(const std::string &rsp) {
+    if (!rsp.empty() && rsp[0] == BSPWM_FAILURE) {
+      std::cerr << rsp.c_str() + 1;
+      return 1;
+    }
+    return 0;
   }
 
-  int pipe_read = pipe_fds[0], pipe_write = pipe_fds[1];
+  struct InFlight {
+    int fd;
+    size_t msg; // index into m_queue
+    uint64_t sent_at;
+    std::string rsp;
+  };
+
+  // Kept between flushes so batches don't reallocate
+  std::vector<std::string> m_queue;
+  size_t m_queue_len = 0;
+  std::vector<InFlight> m_in_flight;
+  std::vector<struct pollfd> m_fds;
 
-  int pid = fork();
-  if (pid == 0) {
-    dup2(pipe_write, STDOUT_FILENO);
-    const char *const args[] = {"bspc", "subscribe", "node", nullptr};
-    execvp(args[0], (char *const *) args);
-  } else {
-    close(pipe_write);
+public:
+  // Answers requests from recorded exchanges instead of talking to bspwm
+  explicit Bspwm(std::deque<std::pair<std::string, std::string>> replay)
+      : m_replaying(true), m_replay(std::move(replay)) {}
+
+  Bspwm() {
+    m_address.sun_family = AF_UNIX;
+
+    const char *sock_path = getenv(BSPWM_SOCKET_ENV);
+    if (sock_path) {
+      std::snprintf(m_address.sun_path, sizeof(m_address.sun_path), "%s",
+                    sock_path);
+      return;
+    }
+
+    std::string host;
+    int display, screen;
+    if (!parse_display(getenv("DISPLAY"), host, display, screen)) {
+      err("Failed to determine the bspwm socket path");
+    }
+
+    std::snprintf(m_address.sun_path, sizeof(m_address.sun_path),
+                  BSPWM_SOCKET_TPL, host.c_str(), display, screen);
   }
 
-  signal(SIGINT, sig_handler);
-  signal(SIGHUP, sig_handler);
-  signal(SIGTERM, sig_handler);
-  signal(SIGPIPE, SIG_IGN);
+  // Returns 0 on success and 1 on failure, like bspc's exit status. Failure
+  // messages go to stderr like they would from bspc.
+  // The reply is read straight into *reply, which keeps its capacity
+  // between requests when the caller reuses it.
+  int request(const char *args[], std::string *reply = nullptr) {
+    std::string &rsp = reply ? *reply : m_rsp;
+    rsp.clear();
+
+    encode(args, m_msg);
+    if (replay(m_msg, rsp)) {
+      return check_reply(rsp);
+    }
 
-  // Create fd for dapper's communication socket
+    Stats::count(BSPWM_REQUESTS);
+    ScopedTimer timer(OP_BSPWM);
 
-  struct sockaddr_un sock_address = {};
-  sock_address.sun_family = AF_UNIX;
-  std::snprintf(sock_address.sun_path, sizeof(sock_address.sun_path), "%s",
-                SOCKET_PATH);
+    int fd = send_message(m_msg);
+    if (fd == -1) {
+      return 1;
+    }
 
-  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ssize_t n;
+    while ((n = recv(fd, buffer, BUF_SIZE, 0)) > 0) {
+      rsp.append(buffer, static_cast<size_t>(n));
+    }
+    close(fd);
 
-  if (sock_fd == -1) {
-    err("Couldn't create the socket");
+    if (m_log) {
+      m_log->write_reply(m_msg, rsp);
+    }
+    return check_reply(rsp);
   }
 
-  unlink(SOCKET_PATH);
-  if (bind(sock_fd, (struct sockaddr *) &sock_address, sizeof(sock_address)) ==
-      -1) {
-    err("Couldn't bind a name to the socket");
+  void record_to(EventLog *log) {
+    m_log = log;
   }
 
-  if (listen(sock_fd, SOMAXCONN) == -1) {
-    err("Couldn't listen to the socket");
+  long replay_misses() const { return m_replay_misses; }
+
+  // Queues a request for the next flush() instead of sending it right away
+  void queue(const char *args[]) {
+    if (m_queue_len == m_queue.size()) {
+      m_queue.emplace_back();
+    }
+    encode(args, m_queue[m_queue_len++]);
   }
 
-  // Loop over input fds
+  // Sends all queued requests over parallel connections and waits for their
+  // replies together. Returns the number of requests that failed.
+  int flush() {
+    auto &in_flight = m_in_flight;
+    auto &fds = m_fds;
+    size_t next = 0;
+    int failures = 0;
+
+    if (m_replaying) {
+      for (; next < m_queue_len; next++) {
+        replay(m_queue[next], m_rsp);
+        failures += check_reply(m_rsp);
+        m_rsp.clear();
+      }
+    }
+
+    while (next < m_queue_len || !in_flight.empty()) {
+      while (next < m_queue_len && in_flight.size() < MAX_IN_FLIGHT) {
+        Stats::count(BSPWM_REQUESTS);
+        uint64_t sent_at = now_ns();
+        int fd = send_message(m_queue[next]);
+        if (fd == -1) {
+          failures++;
+        } else {
+          in_flight.emplace_back();
+          in_flight.back().fd = fd;
+          in_flight.back().msg = next;
+          in_flight.back().sent_at = sent_at;
+        }
+        next++;
+      }
 
-  Dapper dapper;
-  running = true;
-  int max_fd = MAX(sock_fd, pipe_read);
+      if (in_flight.empty()) {
+        continue;
+      }
 
-  while (running) {
-    fd_set descriptors;
-    FD_ZERO(&descriptors);
-    FD_SET(sock_fd, &descriptors);
-    FD_SET(pipe_read, &descriptors);
+      fds.clear();
+      for (auto &req : in_flight) {
+        fds.push_back({req.fd, POLLIN, 0});
+      }
 
-    if (select(max_fd + 1, &descriptors, nullptr, nullptr, nullptr) > 0) {
-      if (FD_ISSET(pipe_read, &descriptors)) {
-        ssize_t n = read(pipe_read, buffer, BUF_SIZE);
-        if (n > 0) {
-          std::string events_str(buffer, static_cast<unsigned long>(n));
-          dapper.handle_events(events_str);
+      if (poll(fds.data(), fds.size(), -1) == -1) {
+        if (errno == EINTR) {
+          continue;
         }
+        break;
       }
 
-      if (FD_ISSET(sock_fd, &descriptors)) {
-        int cli_fd = accept(sock_fd, nullptr, nullptr);
-        if (cli_fd > 0) {
-          ssize_t n = recv(cli_fd, buffer, BUF_SIZE, 0);
-          if (n > 0) {
-            std::string commands_str(buffer, static_cast<unsigned long>(n));
-            dapper.handle_command(commands_str);
-          }
+      // Walk backwards so finished requests can be swapped out in place
+      for (size_t i = fds.size(); i-- > 0;) {
+        if (!fds[i].revents) {
+          continue;
         }
+
+        auto &req = in_flight[i];
+        ssize_t n = recv(req.fd, buffer, BUF_SIZE, 0);
+        if (n > 0) {
+          req.rsp.append(buffer, static_cast<size_t>(n));
+          continue;
+        }
+
+        close(req.fd);
+        Stats::record(OP_BSPWM, now_ns() - req.sent_at);
+        if (m_log) {
+          m_log->write_reply(m_queue[req.msg], req.rsp);
+        }
+        failures += check_reply(req.rsp);
+        req = std::move(in_flight.back());
+        in_flight.pop_back();
       }
     }
+
+    for (auto &req : in_flight) {
+      close(req.fd);
+      failures++;
+    }
+    in_flight.clear();
+    failures += static_cast<int>(m_queue_len - next);
+
+    m_queue_len = 0;
+    return failures;
   }
 
+  // Returns a connected fd that bspwm keeps writing events to
+  int subscribe(const char *args[]) {
+    encode(args, m_msg);
+    return send_message(m_msg);
+  }
+};
+
+// Splits a byte stream into lines. Partial lines stay in the buffer until
+// the rest arrives, and complete lines are handed out as views into it, so
+// nothing is copied per line.
+class LineFramer {
+private:
+  std::vector<char> m_buf;
+  size_t m_start = 0; // first byte not handed out yet
+  size_t m_end = 0;   // end of the bytes read so far
+  size_t m_scan = 0;  // no newline in [m_start, m_scan)
+
+  // Makes room at the end of the buffer for the next read
+  void reserve_tail() {
+    if (m_start > 0) {
+      std::memmove(m_buf.data(), m_buf.data() + m_start, m_end - m_start);
+      m_end -= m_start;
+      m_scan -= m_start;
+      m_start = 0;
+    }
+
+    // A single line longer than the whole buffer
+    if (m_end == m_buf.size()) {
+      m_buf.resize(m_buf.size() * 2);
+    }
+  }
+
+public:
+  explicit LineFramer(size_t capacity = BUF_SIZE) : m_buf(capacity) {}
+
+  // Reads once from fd into the buffer, returns read()'s result
+  ssize_t fill(int fd) {
+    if (m_end == m_buf.size() || m_start == m_end) {
+      reserve_tail();
+    }
+
+    ssize_t n = read(fd, m_buf.data() + m_end, m_buf.size() - m_end);
+    if (n > 0) {
+      m_end += static_cast<size_t>(n);
+    }
+    return n;
+  }
+
+  void feed(const char *data, size_t len) {
+    while (len > 0) {
+      reserve_tail();
+      size_t n = std::min(len, m_buf.size() - m_end);
+      std::memcpy(m_buf.data() + m_end, data, n);
+      m_end += n;
+      data += n;
+      len -= n;
+    }
+  }
+
+  // Gets the next complete line without its newline. The view is valid
+  // until the next fill() or feed().
+  bool next(std::string_view &line) {
+    const char *base = m_buf.data();
+    auto newline = static_cast<const char *>(
+        std::memchr(base + m_scan, '\n', m_end - m_scan));
+    if (!newline) {
+      m_scan = m_end;
+      return false;
+    }
+
+    size_t line_end = static_cast<size_t>(newline - base);
+    line = std::string_view(base + m_start, line_end - m_start);
+    m_start = m_scan = line_end + 1;
+    return true;
+  }
+
+  // Whatever is left after the last newline
+  std::string_view rest() const {
+    return std::string_view(m_buf.data() + m_start, m_end - m_start);
+  }
+};
+
+// Splits line on spaces into at most max fields, the last field gets the
+// rest of the line. Returns the number of fields.
+size_t split_fields(std::string_view line, std::string_view fields[],
+                    size_t max) {
+  size_t count = 0;
+  while (!line.empty() && count < max) {
+    size_t space = count + 1 < max ? line.find(' ') : std::string_view::npos;
+    fields[count++] = line.substr(0, space);
+    if (space == std::string_view::npos) {
+      break;
+    }
+    line.remove_prefix(space + 1);
+  }
+  return count;
+}
+
+// Parses bspwm's 0x-prefixed hexadecimal ids
+int id_of_string(std::string_view str) {
+  if (str.size() > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+    str.remove_prefix(2);
+  }
+
+  unsigned int id = 0;
+  for (char c : str) {
+    int digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      digit = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      digit = c - 'A' + 10;
+    } else {
+      break;
+    }
+    id = id * 16 + static_cast<unsigned int>(digit);
+  }
+  return static_cast<int>(id);
+}
+
+// Pulls client.className out of a `query -n -T` reply and stops parsing as
+// soon as it's found, so the rest of the node is never looked at
+class ClassNameHandler
+    : public BaseReaderHandler<UTF8<>, ClassNameHandler> {
+private:
+  int m_depth = 0;
+  bool m_client_key = false; // last key at the top level was "client"
+  bool m_in_client = false;
+  bool m_class_key = false;
+
+public:
+  std::string_view cls;
+  bool found = false;
+
+  bool StartObject() {
+    m_depth++;
+    m_in_client = m_in_client || (m_depth == 2 && m_client_key);
+    m_client_key = false;
+    return true;
+  }
+
+  bool EndObject(SizeType) {
+    if (m_depth == 2) {
+      m_in_client = false;
+    }
+    m_depth--;
+    return true;
+  }
+
+  bool Key(const char *str, SizeType len, bool) {
+    std::string_view key(str, len);
+    m_client_key = m_depth == 1 && key == "client";
+    m_class_key = m_in_client && m_depth == 2 && key == "className";
+    return true;
+  }
+
+  bool String(const char *str, SizeType len, bool) {
+    if (m_class_key) {
+      cls = std::string_view(str, len);
+      found = true;
+      return false; // done, stop the parser
+    }
+    return Default();
+  }
+
+  bool Default() {
+    m_client_key = false;
+    m_class_key = false;
+    return true;
+  }
+};
+
+// Parses bspwm replies in place. The reply buffer and the parser's stack
+// (carved out of a fixed arena) outlive each query, so once they've grown
+// to fit the usual replies, parsing doesn't touch the heap.
+class ReplyParser {
+private:
+  static constexpr size_t ARENA_SIZE = 16 * 1024;
+  static constexpr size_t STACK_SIZE = 4 * 1024;
+
+  typedef MemoryPoolAllocator<> Arena;
+
+  char m_arena_buf[ARENA_SIZE];
+  Arena m_arena;
+  GenericReader<UTF8<>, UTF8<>, Arena> m_reader;
+  std::string m_reply;
+
+public:
+  ReplyParser()
+      : m_arena(m_arena_buf, sizeof(m_arena_buf)),
+        m_reader(&m_arena, STACK_SIZE) {}
+
+  ReplyParser(const ReplyParser &) = delete;
+  ReplyParser &operator=(const ReplyParser &) = delete;
+
+  // Where the next reply should be read into
+  std::string *buffer() { return &m_reply; }
+
+  // Parses the reply in the buffer. Strings handed to the handler point into
+  // the buffer and stay valid until the next reply is read into it.
+  template <typename Handler> void parse(Handler &handler) {
+    ScopedTimer timer(OP_JSON_PARSE);
+    InsituStringStream stream(&m_reply[0]);
+    m_reader.Parse<kParseInsituFlag>(stream, handler);
+  }
+};
+
+// What we care about in a `wm -d` reply: monitors, desktops and their
+// windows
+struct TreeWindow {
+  int id;
+  std::string cls;
+};
+
+struct TreeDesk {
+  int id = 0;
+  int monitor = 0;
+  std::string name;
+  std::vector<TreeWindow> windows;
+};
+
+struct TreeMonitor {
+  int id = 0;
+  std::string name;
+  int focused_desk = 0;
+};
+
+struct Tree {
+  int focused_monitor = 0;
+  int focused_desk = 0;
+  std::vector<TreeMonitor> monitors;
+  std::vector<TreeDesk> desks;
+};
+
+// Walks the whole tree in one pass, collecting monitor and desktop ids and
+// names and the ids and classes of leaf nodes without building a DOM
+class TreeHandler : public BaseReaderHandler<UTF8<>, TreeHandler> {
+private:
+  enum Kind { OTHER, ARRAY, ROOT, MONITOR, DESKTOP, NODE, CLIENT };
+
+  // Strings point into the reply, which is parsed in place
+  struct Frame {
+    Kind kind;
+    std::string_view key;   // last key seen in this object, or the array's
+    int node_id = 0;        // for nodes
+    bool internal = false;  // node has children
+    bool has_class = false; // node has a client
+    std::string_view cls;
+  };
+
+  std::vector<Frame> m_stack;
+
+  Kind child_kind() const {
+    if (m_stack.empty()) {
+      return ROOT;
+    }
+
+    auto &parent = m_stack.back();
+    auto &key = parent.key;
+    if (key == "monitors") {
+      return MONITOR;
+    } else if (key == "desktops") {
+      return DESKTOP;
+    } else if (key == "root" || key == "firstChild" || key == "secondChild") {
+      return NODE;
+    } else if (key == "client" && parent.kind == NODE) {
+      return CLIENT;
+    }
+    return OTHER;
+  }
+
+  Frame *parent_node() {
+    return m_stack.size() > 1 && m_stack[m_stack.size() - 2].kind == NODE
+               ? &m_stack[m_stack.size() - 2]
+               : nullptr;
+  }
+
+public:
+  Tree tree;
+
+  bool StartObject() {
+    Kind kind = child_kind();
+    if (kind == NODE && !m_stack.empty() && m_stack.back().kind == NODE) {
+      m_stack.back().internal = true;
+    } else if (kind == MONITOR) {
+      tree.monitors.emplace_back();
+    } else if (kind == DESKTOP && !tree.monitors.empty()) {
+      tree.desks.emplace_back();
+      tree.desks.back().monitor = tree.monitors.back().id;
+    }
+
+    m_stack.push_back({kind, {}});
+    return true;
+  }
+
+  bool EndObject(SizeType) {
+    auto &frame = m_stack.back();
+    if (frame.kind == NODE && !frame.internal && frame.has_class &&
+        !tree.desks.empty()) {
+      tree.desks.back().windows.push_back(
+          {frame.node_id, std::string(frame.cls)});
+    } else if (frame.kind == ROOT) {
+      for (auto &monitor : tree.monitors) {
+        if (monitor.id == tree.focused_monitor) {
+          tree.focused_desk = monitor.focused_desk;
+        }
+      }
+    }
+    m_stack.pop_back();
+    return true;
+  }
+
+  bool StartArray() {
+    std::string_view key = m_stack.empty() ? "" : m_stack.back().key;
+    m_stack.push_back({ARRAY, key});
+    return true;
+  }
+
+  bool EndArray(SizeType) {
+    m_stack.pop_back();
+    return true;
+  }
+
+  bool Key(const char *str, SizeType len, bool) {
+    m_stack.back().key = std::string_view(str, len);
+    return true;
+  }
+
+  bool Uint(unsigned u) {
+    auto &frame = m_stack.back();
+    int id = static_cast<int>(u);
+
+    if (frame.key == "id") {
+      if (frame.kind == MONITOR) {
+        tree.monitors.back().id = id;
+      } else if (frame.kind == DESKTOP) {
+        tree.desks.back().id = id;
+      } else if (frame.kind == NODE) {
+        frame.node_id = id;
+      }
+    } else if (frame.key == "focusedDesktopId" && frame.kind == MONITOR) {
+      tree.monitors.back().focused_desk = id;
+    } else if (frame.key == "focusedMonitorId" && frame.kind == ROOT) {
+      tree.focused_monitor = id;
+    }
+    return true;
+  }
+
+  bool String(const char *str, SizeType len, bool) {
+    auto &frame = m_stack.back();
+    if (frame.key == "name" && frame.kind == MONITOR) {
+      tree.monitors.back().name.assign(str, len);
+    } else if (frame.key == "name" && frame.kind == DESKTOP) {
+      tree.desks.back().name.assign(str, len);
+    } else if (frame.key == "className" && frame.kind == CLIENT) {
+      auto node = parent_node();
+      if (node) {
+        node->cls = std::string_view(str, len);
+        node->has_class = true;
+      }
+    }
+    return true;
+  }
+};
+
+// Window id -> value table for the lookups done on every event. Open
+// addressing with linear probing keeps it in one flat array, and erasing
+// shifts entries back instead of leaving tombstones. Id 0 marks an empty
+// slot, X never hands it out.
+template <typename V> class IdMap {
+private:
+  struct Slot {
+    int key = 0;
+    V value{};
+  };
+
+  std::vector<Slot> m_slots;
+  size_t m_size = 0;
+  int m_shift = 32; // 32 - log2(capacity)
+
+  size_t home(int key) const {
+    // Fibonacci hashing, sequential ids end up far apart
+    return (static_cast<uint32_t>(key) * 2654435769u) >> m_shift;
+  }
+
+  size_t probe(int key) const {
+    size_t mask = m_slots.size() - 1;
+    size_t i = home(key);
+    while (m_slots[i].key != 0 && m_slots[i].key != key) {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  void grow() {
+    std::vector<Slot> old(m_slots.empty() ? 16 : m_slots.size() * 2);
+    old.swap(m_slots);
+    m_shift = 32 - __builtin_ctzll(m_slots.size());
+    for (auto &slot : old) {
+      if (slot.key != 0) {
+        m_slots[probe(slot.key)] = std::move(slot);
+      }
+    }
+  }
+
+public:
+  size_t size() const {
+    return m_size;
+  }
+
+  V *find(int key) {
+    if (m_slots.empty()) {
+      return nullptr;
+    }
+    auto &slot = m_slots[probe(key)];
+    return slot.key == key ? &slot.value : nullptr;
+  }
+
+  V &operator[](int key) {
+    // Kept at most half full so probes stay short
+    if ((m_size + 1) * 2 > m_slots.size()) {
+      grow();
+    }
+    auto &slot = m_slots[probe(key)];
+    if (slot.key != key) {
+      slot.key = key;
+      m_size++;
+    }
+    return slot.value;
+  }
+
+  void erase(int key) {
+    if (m_slots.empty()) {
+      return;
+    }
+    size_t mask = m_slots.size() - 1;
+    size_t hole = probe(key);
+    if (m_slots[hole].key != key) {
+      return;
+    }
+
+    // Pull back every later entry of the run that may live in the hole
+    for (size_t i = (hole + 1) & mask; m_slots[i].key != 0; i = (i + 1) & mask) {
+      if (((i - home(m_slots[i].key)) & mask) >= ((i - hole) & mask)) {
+        m_slots[hole] = std::move(m_slots[i]);
+        hole = i;
+      }
+    }
+    m_slots[hole] = Slot();
+    m_size--;
+  }
+
+  // f(key, value&) for every entry
+  template <typename F> void for_each(F f) {
+    for (auto &slot : m_slots) {
+      if (slot.key != 0) {
+        f(slot.key, slot.value);
+      }
+    }
+  }
+};
+
+// bspwm's monitors, desktops and windows, loaded from a `wm -d` snapshot
+// and kept up to date from events so that nothing about the layout has to
+// be asked on the hot path. Only windows (leaves with a client) are kept,
+// with a desktop of 0 when we lost track of where one is.
+class TreeMirror {
+public:
+  struct Monitor {
+    int id;
+    std::string name;
+    int active_desk;        // the desktop it shows
+    std::vector<int> desks; // in order
+  };
+
+  struct Desk {
+    int monitor;
+    std::string name;
+  };
+
+  std::vector<Monitor> monitors;
+  std::unordered_map<int, Desk> desks; // desktop id ->
+  IdMap<int> windows;                  // window id -> desktop id
+  int focused_desk = 0;
+
+  // Takes the monitors, desktops and focus, the windows are up to the caller
+  void load_layout(const Tree &tree) {
+    monitors.clear();
+    desks.clear();
+    for (auto &monitor : tree.monitors) {
+      monitors.push_back({monitor.id, monitor.name, monitor.focused_desk, {}});
+    }
+    for (auto &desk : tree.desks) {
+      add_desk(desk.monitor, desk.id, desk.name);
+    }
+    focused_desk = tree.focused_desk;
+  }
+
+  bool same_layout(const Tree &tree) const {
+    if (tree.monitors.size() != monitors.size() ||
+        tree.desks.size() != desks.size() ||
+        tree.focused_desk != focused_desk) {
+      return false;
+    }
+
+    for (size_t i = 0; i < monitors.size(); i++) {
+      auto &monitor = tree.monitors[i];
+      if (monitor.id != monitors[i].id || monitor.name != monitors[i].name ||
+          monitor.focused_desk != monitors[i].active_desk) {
+        return false;
+      }
+    }
+    for (auto &desk : tree.desks) {
+      auto desk_it = desks.find(desk.id);
+      if (desk_it == desks.end() || desk_it->second.monitor != desk.monitor ||
+          desk_it->second.name != desk.name) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Monitor *monitor(int id) {
+    for (auto &monitor : monitors) {
+      if (monitor.id == id) {
+        return &monitor;
+      }
+    }
+    return nullptr;
+  }
+
+  // nullptr for desktops we don't know
+  const std::string *desk_name(int desk_id) const {
+    auto desk_it = desks.find(desk_id);
+    return desk_it == desks.end() ? nullptr : &desk_it->second.name;
+  }
+
+  // 0 for names we don't know
+  int desk_id(const std::string &name) const {
+    for (auto &desk : desks) {
+      if (desk.second.name == name) {
+        return desk.first;
+      }
+    }
+    return 0;
+  }
+
+  // The first desktop, in monitor order, that doesn't match skip
+  template <typename F> const std::string *first_desk_name(F skip) const {
+    for (auto &monitor : monitors) {
+      for (int desk_id : monitor.desks) {
+        auto &name = desks.at(desk_id).name;
+        if (!skip(name)) {
+          return &name;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  void add_monitor(int id, std::string name) {
+    if (!monitor(id)) {
+      monitors.push_back({id, std::move(name), 0, {}});
+    }
+  }
+
+  void rename_monitor(int id, std::string name) {
+    if (auto mon = monitor(id)) {
+      mon->name = std::move(name);
+    }
+  }
+
+  // Its desktops are moved elsewhere by bspwm, which the next check picks up
+  void remove_monitor(int id) {
+    auto mon = monitor(id);
+    if (!mon) {
+      return;
+    }
+    for (int desk_id : mon->desks) {
+      desks.erase(desk_id);
+      lose_track_of_desk(desk_id);
+    }
+    monitors.erase(monitors.begin() + (mon - monitors.data()));
+  }
+
+  // bspwm swaps the monitors' desktops
+  void swap_monitors(int a, int b) {
+    auto mon_a = monitor(a), mon_b = monitor(b);
+    if (!mon_a || !mon_b) {
+      return;
+    }
+    std::swap(mon_a->desks, mon_b->desks);
+    std::swap(mon_a->active_desk, mon_b->active_desk);
+    for (auto mon : {mon_a, mon_b}) {
+      for (int desk_id : mon->desks) {
+        desks[desk_id].monitor = mon->id;
+      }
+    }
+  }
+
+  void focus_monitor(int id) {
+    if (auto mon = monitor(id)) {
+      focused_desk = mon->active_desk;
+    }
+  }
+
+  // Also used for desktops we made before hearing about them, and to move
+  // desktops between monitors
+  void add_desk(int monitor_id, int id, std::string name) {
+    auto desk_it = desks.find(id);
+    if (desk_it == desks.end()) {
+      desk_it = desks.emplace(id, Desk{0, ""}).first;
+    } else {
+      detach_desk(id, desk_it->second.monitor);
+    }
+
+    desk_it->second = {monitor_id, std::move(name)};
+    if (auto mon = monitor(monitor_id)) {
+      mon->desks.push_back(id);
+    }
+  }
+
+  void detach_desk(int id, int monitor_id) {
+    if (auto mon = monitor(monitor_id)) {
+      mon->desks.erase(std::remove(mon->desks.begin(), mon->desks.end(), id),
+                       mon->desks.end());
+    }
+  }
+
+  void rename_desk(int id, std::string name) {
+    auto desk_it = desks.find(id);
+    if (desk_it != desks.end()) {
+      desk_it->second.name = std::move(name);
+    }
+  }
+
+  void remove_desk(int id) {
+    auto desk_it = desks.find(id);
+    if (desk_it == desks.end()) {
+      return;
+    }
+    detach_desk(id, desk_it->second.monitor);
+    desks.erase(desk_it);
+    lose_track_of_desk(id);
+  }
+
+  void transfer_desk(int id, int dst_monitor) {
+    auto desk_it = desks.find(id);
+    if (desk_it != desks.end()) {
+      add_desk(dst_monitor, id, desk_it->second.name);
+    }
+  }
+
+  // Desktops trade places, possibly across monitors
+  void swap_desks(int a, int b) {
+    auto desk_a = desks.find(a), desk_b = desks.find(b);
+    if (desk_a == desks.end() || desk_b == desks.end()) {
+      return;
+    }
+    auto mon_a = monitor(desk_a->second.monitor);
+    auto mon_b = monitor(desk_b->second.monitor);
+    if (!mon_a || !mon_b) {
+      return;
+    }
+
+    auto pos_a = std::find(mon_a->desks.begin(), mon_a->desks.end(), a);
+    auto pos_b = std::find(mon_b->desks.begin(), mon_b->desks.end(), b);
+    std::iter_swap(pos_a, pos_b);
+    std::swap(desk_a->second.monitor, desk_b->second.monitor);
+  }
+
+  // The desktop a monitor shows changed, without focus necessarily moving
+  void activate_desk(int monitor_id, int id) {
+    if (auto mon = monitor(monitor_id)) {
+      mon->active_desk = id;
+    }
+  }
+
+  void focus_desk(int monitor_id, int id) {
+    activate_desk(monitor_id, id);
+    focused_desk = id;
+  }
+
+  // Forgets where the windows on a desktop are
+  void lose_track_of_desk(int desk_id) {
+    windows.for_each([desk_id](int, int &desk) {
+      if (desk == desk_id) {
+        desk = 0;
+      }
+    });
+  }
+};
+
+// Apps are numbered in config order, so the state kept about them lives in
+// vectors indexed by AppId rather than in maps keyed by name
+typedef uint32_t AppId;
+
+struct App {
+  std::string name; // also the name of its desktop
+  std::vector<std::string> commands;
+  std::vector<std::string> classes;
+};
+
+struct Config {
+  std::vector<App> apps;                          // by AppId
+  std::unordered_map<std::string, AppId> app_ids; // app name -> AppId
+  std::string launcher;
+
+  // With lazy desktops an app's desktop only exists while it's in use, and
+  // goes away after being empty for desktop_gc_ms
+  bool lazy_desktops = false;
+  uint64_t desktop_gc_ms = 0;
+
+  std::string text; // as read, for logs
+
+  bool is_app(const std::string &name) const {
+    return app_ids.find(name) != app_ids.end();
+  }
+};
+
+// Reads the config file into config, or the given text instead, e.g. from a
+// log. Returns false with a message in error if the file can't be read or
+// doesn't look like a config.
+bool load_config(Config &config, std::string &error,
+                 const std::string *text = nullptr) {
+  std::string path = config_path();
+  if (text) {
+    config.text = *text;
+  } else {
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file) {
+      error = "Could not read config file at: " + path;
+      return false;
+    }
+    config.text = read_file(file);
+  }
+
+  // Parsed in place, so from a copy
+  std::string json = config.text;
+  Document doc;
+  doc.ParseInsitu(&json[0]);
+  if (doc.HasParseError() || !doc.IsObject()) {
+    error = text ? "Could not parse the logged config"
+                 : "Could not parse config file at: " + path;
+    return false;
+  }
+
+  auto strings = [](const Value &obj, const char *key,
+                    std::vector<std::string> &out) {
+    auto member = obj.FindMember(key);
+    if (member == obj.MemberEnd() || !member->value.IsArray()) {
+      return false;
+    }
+    for (auto &str : member->value.GetArray()) {
+      if (!str.IsString()) {
+        return false;
+      }
+      out.emplace_back(str.GetString(), str.GetStringLength());
+    }
+    return true;
+  };
+
+  auto apps = doc.FindMember("apps");
+  auto launcher = doc.FindMember("launcher");
+  if (apps == doc.MemberEnd() || !apps->value.IsObject() ||
+      launcher == doc.MemberEnd() || !launcher->value.IsString()) {
+    error = "Config needs an \"apps\" object and a \"launcher\" string";
+    return false;
+  }
+
+  for (auto &entry : apps->value.GetObject()) {
+    App app;
+    app.name = entry.name.GetString();
+    if (!entry.value.IsObject() ||
+        !strings(entry.value, "commands", app.commands) ||
+        !strings(entry.value, "classes", app.classes) ||
+        app.commands.empty()) {
+      error = "App " + app.name + " needs \"commands\" and \"classes\" lists";
+      return false;
+    }
+
+    config.app_ids[app.name] = static_cast<AppId>(config.apps.size());
+    config.apps.push_back(std::move(app));
+  }
+
+  config.launcher = launcher->value.GetString();
+
+  // "lazy_desktops": seconds an unused app desktop is kept around
+  auto lazy = doc.FindMember("lazy_desktops");
+  if (lazy != doc.MemberEnd()) {
+    if (!lazy->value.IsNumber() || lazy->value.GetDouble() < 0) {
+      error = "\"lazy_desktops\" needs to be a number of seconds";
+      return false;
+    }
+    config.lazy_desktops = true;
+    config.desktop_gc_ms =
+        static_cast<uint64_t>(lazy->value.GetDouble() * 1000);
+  }
+  return true;
+}
+
+// Finds the app a window class belongs to. Plain classes go in a minimal
+// perfect hash built once from the config (hash and displace: every bucket
+// of keys gets a seed that sends them to free slots), so an exact match is
+// two hashes and a compare. Config classes can also be patterns, tried in
+// order when no exact class matches: "Foo*" matches by prefix, anything else
+// with *, ? or [ is a glob and "/.../" is a regex.
+class ClassMatcher {
+private:
+  struct Entry {
+    std::string cls;
+    AppId app;
+  };
+
+  struct Pattern {
+    enum Kind { PREFIX, GLOB, REGEX } kind;
+    std::string text;
+    std::regex regex;
+    AppId app;
+  };
+
+  std::vector<Entry> m_slots;
+  std::vector<uint32_t> m_seeds; // by bucket
+  std::vector<Pattern> m_patterns;
+
+  static uint64_t hash(std::string_view str, uint64_t seed) {
+    // FNV-1a with the seed folded into the offset basis
+    uint64_t h = 14695981039346656037ull ^ (seed * 0x9e3779b97f4a7c15ull);
+    for (char c : str) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 1099511628211ull;
+    }
+    return h ^ (h >> 32);
+  }
+
+  // Lays the classes out so that each one is found with its bucket's seed
+  void build(std::vector<Entry> entries) {
+    size_t n = entries.size();
+    m_seeds.assign(n, 0);
+    m_slots.assign(n, {});
+    if (n == 0) {
+      return;
+    }
+
+    std::vector<std::vector<size_t>> buckets(n);
+    for (size_t i = 0; i < n; i++) {
+      buckets[hash(entries[i].cls, 0) % n].push_back(i);
+    }
+
+    // Big buckets are the hardest to place, so they go while there's room
+    std::vector<size_t> order(n);
+    for (size_t b = 0; b < n; b++) {
+      order[b] = b;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<bool> taken(n);
+    std::vector<size_t> placed;
+    for (size_t b : order) {
+      if (buckets[b].empty()) {
+        break;
+      }
+
+      for (uint32_t seed = 1;; seed++) {
+        placed.clear();
+        for (size_t i : buckets[b]) {
+          size_t slot = hash(entries[i].cls, seed) % n;
+          if (taken[slot] ||
+              std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+            break;
+          }
+          placed.push_back(slot);
+        }
+
+        if (placed.size() == buckets[b].size()) {
+          m_seeds[b] = seed;
+          for (size_t k = 0; k < placed.size(); k++) {
+            taken[placed[k]] = true;
+            m_slots[placed[k]] = std::move(entries[buckets[b][k]]);
+          }
+          break;
+        }
+      }
+    }
+  }
+
+public:
+  ClassMatcher() = default;
+
+  explicit ClassMatcher(const std::vector<App> &apps) {
+    // A class listed twice belongs to the last app that lists it
+    std::unordered_map<std::string, AppId> exact;
+
+    for (AppId app = 0; app < apps.size(); app++) {
+      for (auto &cls : apps[app].classes) {
+        size_t len = cls.size();
+        if (len >= 2 && cls.front() == '/' && cls.back() == '/') {
+          try {
+            m_patterns.push_back({Pattern::REGEX, cls,
+                                  std::regex(cls.substr(1, len - 2)), app});
+          } catch (const std::regex_error &) {
+            std::cerr << "Ignoring invalid class regex " << cls << std::endl;
+          }
+
+        } else if (cls.find_first_of("*?[") == std::string::npos) {
+          exact[cls] = app;
+
+        } else if (cls.find_first_of("*?[") == len - 1 && cls.back() == '*') {
+          m_patterns.push_back(
+              {Pattern::PREFIX, cls.substr(0, len - 1), std::regex(), app});
+
+        } else {
+          m_patterns.push_back({Pattern::GLOB, cls, std::regex(), app});
+        }
+      }
+    }
+
+    std::vector<Entry> entries;
+    for (auto &cls : exact) {
+      entries.push_back({cls.first, cls.second});
+    }
+    build(std::move(entries));
+  }
+
+  // Returns the app's id, or false if the class isn't any app's
+  bool find(const std::string &cls, AppId &app) const {
+    if (!m_slots.empty()) {
+      uint32_t seed = m_seeds[hash(cls, 0) % m_seeds.size()];
+      auto &entry = m_slots[hash(cls, seed) % m_slots.size()];
+      if (entry.cls == cls) {
+        app = entry.app;
+        return true;
+      }
+    }
+
+    for (auto &pattern : m_patterns) {
+      bool match = false;
+      switch (pattern.kind) {
+      case Pattern::PREFIX:
+        match = cls.compare(0, pattern.text.size(), pattern.text) == 0;
+        break;
+      case Pattern::GLOB:
+        match = fnmatch(pattern.text.c_str(), cls.c_str(), 0) == 0;
+        break;
+      case Pattern::REGEX:
+        match = std::regex_match(cls, pattern.regex);
+        break;
+      }
+
+      if (match) {
+        app = pattern.app;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// The events Dapper::handle_event acts on. Only these are subscribed to, so
+// the floods of node_geometry, node_flag etc. a resize or drag produces never
+// reach dapper.
+static const char *EVENT_NAMES[] = {
+    "node_add",         "node_remove",      "node_transfer",  "node_swap",
+    "desktop_add",      "desktop_rename",   "desktop_remove", "desktop_focus",
+    "desktop_activate", "desktop_transfer", "desktop_swap",   "monitor_add",
+    "monitor_rename",   "monitor_remove",   "monitor_swap",   "monitor_focus"};
+
+// Whether a line starts with one of EVENT_NAMES. An older subscription, e.g.
+// one inherited over a restart, can still deliver others.
+bool wanted_event(std::string_view line) {
+  std::string_view name = line.substr(0, line.find(' '));
+  for (const char *event : EVENT_NAMES) {
+    if (name == event) {
+      return true;
+    }
+  }
+  return false;
+}
+
+class Dapper {
+private:
+  Bspwm &m_bspwm;
+  Processes &m_procs;
+  EventLoop &m_loop;
+  EventLog *m_log = nullptr; // gets every config that's loaded, if set
+  ReplyParser m_replies;
+  std::string m_shell;
+  Config m_config;
+
+  std::string m_spare_desk; // where to move windows when we need to
+
+  ClassMatcher m_classes;                              // class -> app
+  std::vector<std::vector<int>> m_app_windows;         // by AppId
+  IdMap<AppId> m_window_apps;                          // window id -> app
+  std::unordered_map<int, std::string> m_window_classes; // window id -> class
+
+  // Monitors, desktops and where every window is, from a snapshot at startup
+  // and events since. It's compared with a fresh snapshot every so often,
+  // and soon after an event that it couldn't follow.
+  TreeMirror m_tree;
+  EventLoop::TimerId m_check_timer = 0;
+  static constexpr uint64_t CHECK_INTERVAL_MS = 30000;
+  static constexpr uint64_t CHECK_SOON_MS = 50;
+
+  // Windows that were mapped before their WM_CLASS was set (Spotify does
+  // this), to be looked at again with exponential backoff
+  struct PendingWindow {
+    int attempts = 0;
+    EventLoop::TimerId timer = 0;
+  };
+  std::unordered_map<int, PendingWindow> m_pending_windows; // window id ->
+  static constexpr int CLASS_RETRIES = 8;
+  static constexpr uint64_t CLASS_RETRY_MS = 25; // doubles every attempt
+
+  // Apps that were started but haven't mapped a window yet, so that pressing
+  // the key again while a slow app starts doesn't start another one
+  struct Launch {
+    uint64_t serial;
+    pid_t pid;
+    bool pull; // what the latest request wanted once the window shows up
+    EventLoop::TimerId timeout;
+    int menu_fd = -1; // while the launcher menu is open
+  };
+  std::unordered_map<AppId, Launch> m_launches;
+  uint64_t m_launch_serial = 0;
+  static constexpr uint64_t LAUNCH_TIMEOUT_MS = 30000;
+
+  // Lazy app desktops waiting to be removed if they stay empty
+  std::unordered_map<int, EventLoop::TimerId> m_desk_gc; // desktop id ->
+
+  // The config is reloaded when it changes on disk, once writes settle down
+  int m_inotify_fd = -1;
+  EventLoop::TimerId m_reload_timer = 0;
+  static constexpr uint64_t RELOAD_DELAY_MS = 100;
+
+  pid_t spawn_shell(const std::string &shell_cmd,
+                    std::function<void(int)> on_exit = nullptr) {
+    const char *cmd[] = {m_shell.c_str(), "-c", shell_cmd.c_str(), nullptr};
+    return m_procs.spawn(cmd, std::move(on_exit));
+  }
+
+  // Starts the app and keeps track of it until its first window maps, the
+  // shell fails or the launch times out
+  void launch(AppId app, const std::string &shell_cmd, bool pull) {
+    uint64_t serial = ++m_launch_serial;
+    pid_t pid = spawn_shell(shell_cmd, [this, serial](int status) {
+      // A zero exit may just mean the app went to the background
+      if (status != 0) {
+        end_launch(serial);
+      }
+    });
+    if (pid == -1) {
+      return;
+    }
+
+    auto timeout = m_loop.defer(LAUNCH_TIMEOUT_MS,
+                                [this, serial] { end_launch(serial); });
+    m_launches[app] = {serial, pid, pull, timeout};
+  }
+
+  // Shows the launcher menu with the app's commands and launches the one that
+  // gets picked. The menu is read from the event loop so events keep being
+  // handled while it's open, and it counts as a launch in flight.
+  void open_menu(AppId app, bool pull) {
+    std::string commands;
+    for (auto &cmd : m_config.apps[app].commands) {
+      commands += cmd;
+      commands += '\n';
+    }
+
+    const char *cmd[] = {m_shell.c_str(), "-c", m_config.launcher.c_str(),
+                         nullptr};
+    pid_t pid;
+    int fd = m_procs.capture(cmd, pid, commands);
+    if (fd == -1) {
+      return;
+    }
+
+    uint64_t serial = ++m_launch_serial;
+    m_launches[app] = {serial, pid, pull, 0, fd};
+
+    auto choice = std::make_shared<std::string>();
+    m_loop.add(fd, EPOLLIN, [this, serial, fd, choice](uint32_t) {
+      ssize_t n = read(fd, buffer, BUF_SIZE);
+      if (n > 0) {
+        choice->append(buffer, static_cast<size_t>(n));
+        return;
+      }
+      m_loop.remove(fd);
+      close(fd);
+
+      auto launch_it = find_launch(serial);
+      if (launch_it == m_launches.end()) {
+        return;
+      }
+      launch_it->second.menu_fd = -1;
+
+      // The first line is the pick, nothing means the menu was dismissed
+      std::string picked = choice->substr(0, choice->find('\n'));
+      AppId app = launch_it->first;
+      bool pull = launch_it->second.pull;
+      end_launch(serial);
+      if (!picked.empty()) {
+        launch(app, picked, pull);
+      }
+    });
+  }
+
+  // Callbacks refer to launches by serial, since reloading the config can
+  // renumber the apps
+  std::unordered_map<AppId, Launch>::iterator find_launch(uint64_t serial) {
+    return std::find_if(m_launches.begin(), m_launches.end(),
+                        [serial](const std::pair<const AppId, Launch> &l) {
+                          return l.second.serial == serial;
+                        });
+  }
+
+  void end_launch(uint64_t serial) {
+    auto launch_it = find_launch(serial);
+    if (launch_it != m_launches.end()) {
+      const std::string &name = m_config.apps[launch_it->first].name;
+      m_loop.cancel(launch_it->second.timeout);
+      m_launches.erase(launch_it);
+      schedule_desk_gc(desk_id_of_name(name));
+    }
+  }
+
+  // The app's first window mapped, so finish what the request asked for
+  void complete_launch(AppId app) {
+    auto launch_it = m_launches.find(app);
+    if (launch_it == m_launches.end()) {
+      return;
+    }
+
+    bool pull = launch_it->second.pull;
+    end_launch(launch_it->second.serial);
+
+    const std::string &name = m_config.apps[app].name;
+    reconcile(app, pull);
+    if (!pull && m_tree.focused_desk != desk_id_of_name(name)) {
+      focus_desk(name);
+    }
+  }
+
+  int make_desk(const std::string &name) {
+    const char *cmd[] = {"monitor", "--add-desktops", name.c_str(), nullptr};
+    return m_bspwm.request(cmd);
+  }
+
+  // All in one request
+  int make_desks(const std::vector<std::string> &names) {
+    std::vector<const char *> cmd = {"monitor", "--add-desktops"};
+    for (auto &name : names) {
+      cmd.push_back(name.c_str());
+    }
+    cmd.push_back(nullptr);
+    return m_bspwm.request(cmd.data());
+  }
+
+  int remove_desk(const std::string &name) {
+    const char *cmd[] = {"desktop", name.c_str(), "--remove", nullptr};
+    return m_bspwm.request(cmd);
+  }
+
+  int focus_desk(const std::string &name) {
+    const char *cmd[] = {"desktop", name.c_str(), "--focus", nullptr};
+    return m_bspwm.request(cmd);
+  }
+
+  int move_window(int wid, const std::string &desk) {
+    auto wid_str = std::to_string(wid);
+    const char *cmd[] = {"node", wid_str.c_str(), "--to-desktop", desk.c_str(),
+                         nullptr};
+    Stats::count(MOVES);
+    return m_bspwm.request(cmd);
+  }
+
+  // Like move_window() but sent with the next m_bspwm.flush()
+  void queue_move_window(int wid, const std::string &desk) {
+    auto wid_str = std::to_string(wid);
+    const char *cmd[] = {"node", wid_str.c_str(), "--to-desktop", desk.c_str(),
+                         nullptr};
+    Stats::count(MOVES);
+    m_bspwm.queue(cmd);
+  }
+
+  Tree wm_tree() {
+    const char *cmd[] = {"wm", "-d", nullptr};
+    TreeHandler handler;
+    if (m_bspwm.request(cmd, m_replies.buffer()) == 0) {
+      m_replies.parse(handler);
+    }
+    return std::move(handler.tree);
+  }
+
+  // Returns the id of the app's desktop, creating it first with lazy
+  // desktops. 0 if it isn't known (yet).
+  int ensure_desk(AppId app) {
+    const std::string &name = m_config.apps[app].name;
+    int desk_id = desk_id_of_name(name);
+    if (desk_id || !m_config.lazy_desktops || make_desk(name) != 0) {
+      return desk_id;
+    }
+
+    // Learn the id now rather than from desktop_add, so that it isn't
+    // created twice in the meantime
+    const char *cmd[] = {"query", "-d", name.c_str(), "-D", nullptr};
+    auto &reply = *m_replies.buffer();
+    if (m_bspwm.request(cmd, &reply) != 0) {
+      return 0;
+    }
+    // It went to the focused monitor
+    desk_id = id_of_string(reply);
+    auto focused_it = m_tree.desks.find(m_tree.focused_desk);
+    m_tree.add_desk(focused_it != m_tree.desks.end()
+                        ? focused_it->second.monitor
+                        : 0,
+                    desk_id, name);
+    return desk_id;
+  }
+
+  // (Re)starts the countdown for removing an app desktop that may have been
+  // left empty
+  void schedule_desk_gc(int desk_id) {
+    if (!m_config.lazy_desktops) {
+      return;
+    }
+    auto name = m_tree.desk_name(desk_id);
+    if (!name || !m_config.is_app(*name)) {
+      return;
+    }
+
+    auto &timer = m_desk_gc[desk_id];
+    m_loop.cancel(timer);
+    timer = m_loop.defer(m_config.desktop_gc_ms, [this, desk_id] {
+      m_desk_gc.erase(desk_id);
+      collect_desk(desk_id);
+    });
+  }
+
+  void collect_desk(int desk_id) {
+    auto name = m_tree.desk_name(desk_id);
+    if (!name || desk_id == m_tree.focused_desk) {
+      return;
+    }
+    auto app_it = m_config.app_ids.find(*name);
+    if (app_it == m_config.app_ids.end() || m_launches.count(app_it->second)) {
+      return;
+    }
+
+    bool empty = true;
+    m_tree.windows.for_each([&](int, int desk) { empty &= desk != desk_id; });
+    if (empty) {
+      remove_desk(std::to_string(desk_id));
+    }
+  }
+
+  // The first desktop that isn't an app's, or "" if there's none
+  std::string find_spare_desk(bool make = true) {
+    auto spare = m_tree.first_desk_name(
+        [this](const std::string &name) { return m_config.is_app(name); });
+    if (spare) {
+      return *spare;
+    }
+    if (make) {
+      make_desk("spare");
+    }
+    return "spare";
+  }
+
+  // Desktops we don't know about mean the mirror is out of date, so it gets
+  // checked but the answer has to do for now
+  std::string desk_name_of_id(int desk_id) {
+    auto name = m_tree.desk_name(desk_id);
+    if (name) {
+      return *name;
+    }
+    if (desk_id) {
+      schedule_check(CHECK_SOON_MS);
+    }
+    return "";
+  }
+
+  int desk_id_of_name(const std::string &name) {
+    return m_tree.desk_id(name);
+  }
+
+  void schedule_check(uint64_t delay_ms) {
+    m_loop.cancel(m_check_timer);
+    m_check_timer = m_loop.defer(delay_ms, [this] { check_tree(); });
+  }
+
+  // Brings the mirror in line with a fresh snapshot: windows it missed are
+  // handled like new ones, and the ones that are gone are forgotten
+  void check_tree() {
+    schedule_check(CHECK_INTERVAL_MS);
+    Tree tree = wm_tree();
+    if (tree.monitors.empty()) {
+      return;
+    }
+
+    bool in_sync = m_tree.same_layout(tree);
+    if (!in_sync) {
+      m_tree.load_layout(tree);
+    }
+
+    IdMap<bool> seen;
+    for (auto &desk : tree.desks) {
+      for (auto &win : desk.windows) {
+        seen[win.id] = true;
+        int *known_desk = m_tree.windows.find(win.id);
+        if (known_desk) {
+          in_sync &= *known_desk == desk.id;
+          *known_desk = desk.id;
+          continue;
+        }
+
+        in_sync = false;
+        if (win.cls.empty()) {
+          defer_window(win.id, desk.id);
+          continue;
+        }
+        m_window_classes[win.id] = win.cls;
+        classify_window(win.id, desk.id, win.cls, true);
+      }
+    }
+
+    std::vector<int> gone;
+    m_tree.windows.for_each([&](int wid, int) {
+      if (!seen.find(wid)) {
+        gone.push_back(wid);
+      }
+    });
+    for (int wid : gone) {
+      forget_window(wid);
+      in_sync = false;
+    }
+
+    m_bspwm.flush();
+    if (!in_sync) {
+      Stats::count(TREE_RESYNCS);
+    }
+  }
+
+  void forget_window(int wid) {
+    m_window_classes.erase(wid);
+    m_tree.windows.erase(wid);
+    forget_pending_window(wid);
+
+    AppId *wapp = m_window_apps.find(wid);
+    if (wapp) {
+      auto &windows = m_app_windows[*wapp];
+      auto win_it = std::find(windows.begin(), windows.end(), wid);
+      if (win_it != windows.end()) {
+        *win_it = windows.back();
+        windows.pop_back();
+      }
+      m_window_apps.erase(wid);
+    }
+  }
+
+  // Looks up the window's class, asking bspwm only until it has one. Returns
+  // nullptr for nodes without a client.
+  const std::string *window_class(int wid) {
+    ScopedTimer timer(OP_CLASSIFY);
+    auto cls_it = m_window_classes.find(wid);
+    if (cls_it != m_window_classes.end()) {
+      return &cls_it->second;
+    }
+
+    auto wid_str = std::to_string(wid);
+    const char *node_cmd[] = {"query", "-n", wid_str.c_str(), "-T", nullptr};
+    if (m_bspwm.request(node_cmd, m_replies.buffer()) != 0) {
+      return nullptr;
+    }
+
+    ClassNameHandler handler;
+    m_replies.parse(handler);
+    if (!handler.found) {
+      return nullptr;
+    }
+
+    // The class may still be set later, so don't remember an empty one
+    static const std::string no_class;
+    if (handler.cls.empty()) {
+      return &no_class;
+    }
+    return &(m_window_classes[wid] = std::string(handler.cls));
+  }
+
+  void handle_window(int wid, int desk_id) {
+    auto cls_ptr = window_class(wid);
+    if (!cls_ptr) {
+      return;
+    }
+
+    if (cls_ptr->empty() && defer_window(wid, desk_id)) {
+      return;
+    }
+    classify_window(wid, desk_id, *cls_ptr);
+  }
+
+  // Schedules another look at a window without a class. Returns false once
+  // it has run out of retries and should be classified as it is.
+  bool defer_window(int wid, int desk_id) {
+    auto &pending = m_pending_windows[wid];
+    if (pending.attempts == CLASS_RETRIES) {
+      m_pending_windows.erase(wid);
+      return false;
+    }
+
+    // Keep following the window around while it waits
+    m_tree.windows[wid] = desk_id;
+    pending.timer = m_loop.defer(CLASS_RETRY_MS << pending.attempts++,
+                                 [this, wid] { retry_window(wid); });
+    return true;
+  }
+
+  void retry_window(int wid) {
+    int *desk = m_tree.windows.find(wid);
+    if (m_pending_windows.count(wid) && desk) {
+      handle_window(wid, *desk);
+    }
+  }
+
+  void forget_pending_window(int wid) {
+    auto pending_it = m_pending_windows.find(wid);
+    if (pending_it != m_pending_windows.end()) {
+      m_loop.cancel(pending_it->second.timer);
+      m_pending_windows.erase(pending_it);
+    }
+  }
+
+  // With batch set, moves are queued for the next m_bspwm.flush()
+  void classify_window(int wid, int desk_id, const std::string &cls,
+                       bool batch = false) {
+    // Determine if window needs moving. If it's an app window it does, if
+    // it's a non-app window and it's on an app desktop, it also does.
+
+    forget_pending_window(wid);
+
+    AppId app;
+    if (m_classes.find(cls, app)) {
+      // This is a valid app window!
+
+      if (!m_window_apps.find(wid)) {
+        m_app_windows[app].push_back(wid);
+        m_window_apps[wid] = app;
+      }
+      // It stays where it is until the app is focused, so with lazy
+      // desktops there's no desktop to make for it yet
+      m_tree.windows[wid] = desk_id;
+      complete_launch(app);
+
+    } else {
+      // Not an app window, move to other desktop if on app desktop
+      if (!m_config.is_app(desk_name_of_id(desk_id))) {
+        // Stays where it is
+      } else if (batch) {
+        queue_move_window(wid, m_spare_desk);
+        desk_id = desk_id_of_name(m_spare_desk);
+      } else if (move_window(wid, m_spare_desk) == 0) {
+        desk_id = desk_id_of_name(m_spare_desk);
+      }
+      m_tree.windows[wid] = desk_id;
+    }
+  }
+
+  // Brings bspwm to the desired state for focusing (or pulling) an app: all
+  // of its windows on the target desktop and, when focusing, none of anyone
+  // else's on its desktop. Only windows that aren't already where they
+  // belong are moved, so there are no redundant moves or re-layouts.
+  void reconcile(AppId app, bool pull) {
+    const std::string &name = m_config.apps[app].name;
+    int target = pull ? m_tree.focused_desk : ensure_desk(app);
+    std::string target_desk =
+        target ? std::to_string(target) : pull ? "focused" : name;
+
+    std::vector<std::pair<int, int>> moved; // window id -> desktop id
+
+    for (int wid : m_app_windows[app]) {
+      int *desk = m_tree.windows.find(wid);
+      if (target && desk && *desk == target) {
+        continue;
+      }
+      queue_move_window(wid, target_desk);
+      moved.emplace_back(wid, target);
+    }
+
+    if (!pull && target) {
+      int spare = desk_id_of_name(m_spare_desk);
+      m_tree.windows.for_each([&](int wid, int desk) {
+        if (desk != target) {
+          return;
+        }
+
+        // Other apps' windows go home, the rest to the spare desktop
+        AppId *wapp = m_window_apps.find(wid);
+        if (!wapp) {
+          queue_move_window(wid, m_spare_desk);
+          moved.emplace_back(wid, spare);
+        } else if (*wapp != app) {
+          int home = ensure_desk(*wapp);
+          queue_move_window(wid, m_config.apps[*wapp].name);
+          moved.emplace_back(wid, home);
+        }
+      });
+    }
+
+    m_bspwm.flush();
+
+    // The node_transfer events will say the same, but they haven't been
+    // read yet and a repeated command shouldn't move the windows again
+    for (auto &win : moved) {
+      m_tree.windows[win.first] = win.second;
+    }
+  }
+
+  // Swaps in the config on disk, if it's valid. Only desktops of apps that
+  // were added or removed are touched, and windows are sorted out again from
+  // their cached classes without asking bspwm.
+  void reload_config(const std::string *text = nullptr) {
+    Config config;
+    std::string error;
+    if (!load_config(config, error, text)) {
+      std::cerr << error << ", keeping the old config" << std::endl;
+      return;
+    }
+    if (m_log) {
+      m_log->write(EventLog::CONFIG, config.text.data(), config.text.size());
+    }
+
+    Config old = std::move(m_config);
+    m_config = std::move(config);
+    m_classes = ClassMatcher(m_config.apps);
+
+    // Without lazy desktops every app needs one, also those a lazy config
+    // never made
+    std::vector<std::string> missing;
+    for (auto &app : m_config.apps) {
+      if (!m_config.lazy_desktops && !desk_id_of_name(app.name)) {
+        missing.push_back(app.name);
+      }
+    }
+    if (!missing.empty()) {
+      make_desks(missing);
+    }
+    if (m_config.is_app(m_spare_desk)) {
+      m_spare_desk = find_spare_desk();
+    }
+
+    // Desktops of removed apps are emptied before they go
+    std::vector<int> removed_desks;
+    for (auto &app : old.apps) {
+      if (!m_config.is_app(app.name)) {
+        removed_desks.push_back(desk_id_of_name(app.name));
+      }
+    }
+
+    static const std::string no_class;
+    int spare = desk_id_of_name(m_spare_desk);
+    std::vector<std::pair<int, int>> moved; // window id -> desktop id
+    IdMap<AppId> window_apps;
+    m_app_windows.assign(m_config.apps.size(), {});
+
+    m_tree.windows.for_each([&](int wid, int desk) {
+      if (m_pending_windows.count(wid)) {
+        return;
+      }
+
+      auto cls_it = m_window_classes.find(wid);
+      AppId app;
+      bool is_app_window = m_classes.find(
+          cls_it != m_window_classes.end() ? cls_it->second : no_class, app);
+      bool on_removed_desk =
+          desk && std::find(removed_desks.begin(), removed_desks.end(),
+                            desk) != removed_desks.end();
+
+      if (is_app_window) {
+        m_app_windows[app].push_back(wid);
+        window_apps[wid] = app;
+        if (on_removed_desk) {
+          int home = ensure_desk(app);
+          queue_move_window(wid, home ? std::to_string(home)
+                                      : m_config.apps[app].name);
+          moved.emplace_back(wid, home);
+        }
+      } else if (on_removed_desk || m_config.is_app(desk_name_of_id(desk))) {
+        queue_move_window(wid, m_spare_desk);
+        moved.emplace_back(wid, spare);
+      }
+    });
+    m_window_apps = std::move(window_apps);
+
+    m_bspwm.flush();
+    for (auto &win : moved) {
+      m_tree.windows[win.first] = win.second;
+    }
+    for (auto &app : old.apps) {
+      if (!m_config.is_app(app.name) && desk_id_of_name(app.name)) {
+        remove_desk(app.name);
+      }
+    }
+
+    // Launches follow their app to its new id
+    std::unordered_map<AppId, Launch> launches;
+    for (auto &launch : m_launches) {
+      auto id_it = m_config.app_ids.find(old.apps[launch.first].name);
+      if (id_it != m_config.app_ids.end()) {
+        launches[id_it->second] = launch.second;
+      } else {
+        m_loop.cancel(launch.second.timeout);
+      }
+    }
+    m_launches = std::move(launches);
+
+    // Desktops made eagerly may be empty, and can go now
+    if (m_config.lazy_desktops && !old.lazy_desktops) {
+      for (auto &app : m_config.apps) {
+        schedule_desk_gc(desk_id_of_name(app.name));
+      }
+    }
+  }
+
+  // Picks up where the previous process left off, see save_state(). Window
+  // apps come from the classes, so they follow the config as it is now.
+  void restore_state(std::string_view state) {
+    static const std::string no_class;
+
+    while (!state.empty()) {
+      size_t newline = state.find('\n');
+      std::string_view line = state.substr(0, newline);
+      state.remove_prefix(newline == std::string_view::npos ? state.size()
+                                                            : newline + 1);
+
+      constexpr size_t MAX_FIELDS = 4;
+      std::string_view f[MAX_FIELDS];
+      size_t count = split_fields(line, f, MAX_FIELDS);
+      if (count == 0) {
+        continue;
+      }
+
+      if (f[0] == "spare" && count >= 2) {
+        m_spare_desk = std::string(line.substr(6));
+
+      } else if (f[0] == "focused" && count >= 2) {
+        m_tree.focused_desk = id_of_string(f[1]);
+
+      } else if (f[0] == "monitor" && count >= 4) {
+        int id = id_of_string(f[1]);
+        m_tree.add_monitor(id, std::string(f[3]));
+        m_tree.activate_desk(id, id_of_string(f[2]));
+
+      } else if (f[0] == "desk" && count >= 4) {
+        m_tree.add_desk(id_of_string(f[2]), id_of_string(f[1]),
+                        std::string(f[3]));
+
+      } else if (f[0] == "window" && count >= 3) {
+        int wid = id_of_string(f[1]);
+        m_tree.windows[wid] = id_of_string(f[2]);
+        const std::string *cls = &no_class;
+        if (count == 4) {
+          cls = &(m_window_classes[wid] = std::string(f[3]));
+        }
+
+        AppId app;
+        if (m_classes.find(*cls, app)) {
+          m_app_windows[app].push_back(wid);
+          m_window_apps[wid] = app;
+        }
+
+      } else if (f[0] == "pending" && count >= 3) {
+        defer_window(id_of_string(f[1]), id_of_string(f[2]));
+
+      } else if (f[0] == "launch" && count >= 3) {
+        // The launch starts over, an open menu didn't survive
+        auto app_it = m_config.app_ids.find(std::string(f[2]));
+        if (app_it != m_config.app_ids.end()) {
+          uint64_t serial = ++m_launch_serial;
+          auto timeout = m_loop.defer(LAUNCH_TIMEOUT_MS,
+                                      [this, serial] { end_launch(serial); });
+          m_launches[app_it->second] = {serial, 0, f[1] == "pull", timeout};
+        }
+      }
+    }
+
+    for (auto &desk : m_tree.desks) {
+      schedule_desk_gc(desk.first);
+    }
+    schedule_check(CHECK_INTERVAL_MS);
+  }
+
+public:
+  // With state from save_state() nothing is asked of bspwm and no desktops
+  // are made, otherwise everything is set up from scratch. The config is
+  // read from disk unless its text is given.
+  Dapper(Bspwm &bspwm, Processes &procs, EventLoop &loop,
+         const std::string *state = nullptr,
+         const std::string *config = nullptr)
+      : m_bspwm(bspwm), m_procs(procs), m_loop(loop) {
+    // Determine an appropriate shell
+    m_shell = getenv("SHELL");
+    if (m_shell.empty()) {
+      m_shell = "sh";
+    }
+
+    // Read config
+    std::string error;
+    if (!load_config(m_config, error, config)) {
+      err(error);
+    }
+
+    // Build class -> app matcher
+    m_classes = ClassMatcher(m_config.apps);
+    m_app_windows.resize(m_config.apps.size());
+
+    if (state) {
+      restore_state(*state);
+      return;
+    }
+
+    // Everything else comes from one snapshot of the tree, which has every
+    // desktop name and window class in it
+    auto tree = wm_tree();
+    m_tree.load_layout(tree);
+
+    m_spare_desk = find_spare_desk(false);
+    bool make_spare = !desk_id_of_name(m_spare_desk);
+
+    // Process all existing windows like they were newly opened, without
+    // asking bspwm about each of them
+    for (auto &desk : tree.desks) {
+      for (auto &win : desk.windows) {
+        if (win.cls.empty()) {
+          defer_window(win.id, desk.id);
+          continue;
+        }
+        m_window_classes[win.id] = win.cls;
+        classify_window(win.id, desk.id, win.cls, true);
+      }
+    }
+
+    // Create the desktops that are missing (lazy ones wait until their app
+    // is focused) and the spare desktop in one go, then move
+    std::vector<std::string> missing;
+    for (auto &app : m_config.apps) {
+      if (!m_config.lazy_desktops && !desk_id_of_name(app.name)) {
+        missing.push_back(app.name);
+      }
+    }
+    if (make_spare) {
+      missing.push_back(m_spare_desk);
+    }
+    if (!missing.empty()) {
+      make_desks(missing);
+    }
+    m_bspwm.flush();
+
+    // Desktops left over from before may not be needed anymore
+    for (auto &desk : tree.desks) {
+      schedule_desk_gc(desk.id);
+    }
+    schedule_check(CHECK_INTERVAL_MS);
+  }
+
+  ~Dapper() {
+    if (m_inotify_fd != -1) {
+      close(m_inotify_fd);
+    }
+
+    for (auto &launch : m_launches) {
+      if (launch.second.menu_fd != -1) {
+        close(launch.second.menu_fd);
+      }
+    }
+
+    for (auto &app : m_config.apps) {
+      if (!m_config.lazy_desktops || desk_id_of_name(app.name)) {
+        remove_desk(app.name);
+      }
+    }
+  }
+
+  // Logs the config in use and every one reloaded after it
+  void record_to(EventLog *log) {
+    m_log = log;
+    m_log->write(EventLog::CONFIG, m_config.text.data(),
+                 m_config.text.size());
+  }
+
+  // Switches to a config from a log, as if it had been reloaded
+  void replay_config(const std::string &text) { reload_config(&text); }
+
+  // Reloads the config whenever it changes on disk. Editors tend to write a
+  // new file and rename it over the old one, so the directory is watched.
+  void watch_config() {
+    std::string path = config_path();
+    std::string dir = path.substr(0, path.rfind('/'));
+
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd == -1 ||
+        inotify_add_watch(m_inotify_fd, dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+      std::cerr << "Not watching " << dir << " for config changes"
+                << std::endl;
+      return;
+    }
+
+    m_loop.add(m_inotify_fd, EPOLLIN, [this](uint32_t) {
+      alignas(struct inotify_event) char events[4096];
+      bool changed = false;
+      ssize_t n;
+      while ((n = read(m_inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + n;) {
+          auto *event = reinterpret_cast<struct inotify_event *>(p);
+          changed |= event->len && std::strcmp(event->name, "config.json") == 0;
+          p += sizeof(struct inotify_event) + event->len;
+        }
+      }
+
+      if (changed) {
+        m_loop.cancel(m_reload_timer);
+        m_reload_timer =
+            m_loop.defer(RELOAD_DELAY_MS, [this] { reload_config(); });
+      }
+    });
+  }
+
+  // Everything a new process needs to carry on without bootstrapping, one
+  // item per line. Names and classes come last since they may have spaces.
+  std::string save_state() {
+    std::ostringstream out;
+    out << std::hex << std::showbase;
+
+    out << "spare " << m_spare_desk << '\n';
+    out << "focused " << m_tree.focused_desk << '\n';
+    for (auto &monitor : m_tree.monitors) {
+      out << "monitor " << monitor.id << ' ' << monitor.active_desk << ' '
+          << monitor.name << '\n';
+      for (int desk_id : monitor.desks) {
+        out << "desk " << desk_id << ' ' << monitor.id << ' '
+            << m_tree.desks[desk_id].name << '\n';
+      }
+    }
+
+    m_tree.windows.for_each([&](int wid, int desk) {
+      if (m_pending_windows.count(wid)) {
+        out << "pending " << wid << ' ' << desk << '\n';
+        return;
+      }
+      out << "window " << wid << ' ' << desk;
+      auto cls_it = m_window_classes.find(wid);
+      if (cls_it != m_window_classes.end()) {
+        out << ' ' << cls_it->second;
+      }
+      out << '\n';
+    });
+
+    for (auto &launch : m_launches) {
+      out << "launch " << (launch.second.pull ? "pull " : "focus ")
+          << m_config.apps[launch.first].name << '\n';
+    }
+
+    return out.str();
+  }
+
+  // Returns 0 on success, anything meant for the client goes into reply
+  int handle_command(std::string_view command, std::string &reply) {
+    constexpr size_t MAX_WORDS = 4;
+    std::string_view words[MAX_WORDS];
+    size_t count = split_fields(command, words, MAX_WORDS);
+    if (count == 0) {
+      reply = "No command given";
+      return 1;
+    }
+
+    // Built-in commands
+    if (words[0] == "stats") {
+      reply = Stats::report();
+      return 0;
+    }
+
+    Stats::count(COMMANDS);
+    ScopedTimer timer(OP_COMMAND);
+
+    bool pull = count > 1 && words[1] == "--pull";
+
+    auto app_it = m_config.app_ids.find(std::string(words[0]));
+    if (app_it == m_config.app_ids.end()) {
+      reply = "Unknown app: " + std::string(words[0]);
+      return 1;
+    }
+    AppId app = app_it->second;
+    const std::string &name = m_config.apps[app].name;
+
+    if (!m_app_windows[app].empty()) {
+      reconcile(app, pull);
+
+      if (!pull) {
+        focus_desk(name);
+      }
+
+    } else {
+      // Try to open app
+
+      if (!pull) {
+        ensure_desk(app);
+        focus_desk(name);
+      }
+
+      auto launch_it = m_launches.find(app);
+      if (launch_it != m_launches.end()) {
+        // Already on its way, the window goes where this request wants it
+        Stats::count(COALESCED_LAUNCHES);
+        launch_it->second.pull = pull;
+        return 0;
+      }
+
+      auto &commands = m_config.apps[app].commands;
+      if (commands.size() == 1) {
+        launch(app, commands[0], pull);
+
+      } else {
+        open_menu(app, pull);
+      }
+    }
+
+    return 0;
+  }
+
+  void handle_event(std::string_view line) {
+    if (!wanted_event(line)) {
+      return;
+    }
+    Stats::count(EVENTS);
+    ScopedTimer timer(OP_EVENT);
+
+    constexpr size_t MAX_FIELDS = 8;
+    std::string_view words[MAX_FIELDS];
+    // Desktop names may contain spaces, so they get the rest of the line
+    bool named = line.substr(0, 12) == "desktop_add ";
+    size_t count = split_fields(line, words, named ? 4 : MAX_FIELDS);
+    if (count == 0) {
+      return;
+    }
+
+    if (words[0] == "node_add" && count >= 5) {
+      int desk_id = id_of_string(words[2]);
+      int wid = id_of_string(words[4]);
+      handle_window(wid, desk_id);
+
+    } else if (words[0] == "node_remove" && count >= 4) {
+      forget_window(id_of_string(words[3]));
+      schedule_desk_gc(id_of_string(words[2]));
+
+    } else if (words[0] == "node_transfer" && count >= 7) {
+      // A window we know just changes desktop, anything else was a subtree
+      // and we can't tell which windows were in it
+      int src_desk = id_of_string(words[2]);
+      int *desk = m_tree.windows.find(id_of_string(words[3]));
+      if (desk) {
+        *desk = id_of_string(words[5]);
+      } else {
+        m_tree.lose_track_of_desk(src_desk);
+        schedule_check(CHECK_SOON_MS);
+      }
+      schedule_desk_gc(src_desk);
+
+    } else if (words[0] == "node_swap" && count >= 7) {
+      int src_desk = id_of_string(words[2]), dst_desk = id_of_string(words[5]);
+      int *src = m_tree.windows.find(id_of_string(words[3]));
+      int *dst = m_tree.windows.find(id_of_string(words[6]));
+      if (src && dst) {
+        *src = dst_desk;
+        *dst = src_desk;
+      } else {
+        m_tree.lose_track_of_desk(src_desk);
+        m_tree.lose_track_of_desk(dst_desk);
+        schedule_check(CHECK_SOON_MS);
+      }
+
+    } else if (words[0] == "desktop_focus" && count >= 3) {
+      schedule_desk_gc(m_tree.focused_desk);
+      m_tree.focus_desk(id_of_string(words[1]), id_of_string(words[2]));
+
+    } else if (words[0] == "desktop_activate" && count >= 3) {
+      m_tree.activate_desk(id_of_string(words[1]), id_of_string(words[2]));
+
+    } else if (words[0] == "desktop_add" && count >= 4) {
+      int desk_id = id_of_string(words[2]);
+      m_tree.add_desk(id_of_string(words[1]), desk_id, std::string(words[3]));
+      schedule_desk_gc(desk_id);
+
+    } else if (words[0] == "desktop_rename" && count >= 5) {
+      m_tree.rename_desk(id_of_string(words[2]), std::string(words[4]));
+
+    } else if (words[0] == "desktop_transfer" && count >= 4) {
+      m_tree.transfer_desk(id_of_string(words[2]), id_of_string(words[3]));
+
+    } else if (words[0] == "desktop_swap" && count >= 5) {
+      m_tree.swap_desks(id_of_string(words[2]), id_of_string(words[4]));
+
+    } else if (words[0] == "desktop_remove" && count >= 3) {
+      int desk_id = id_of_string(words[2]);
+      const std::string *name = m_tree.desk_name(desk_id);
+      if (!name) {
+        return;
+      }
+
+      auto gc_it = m_desk_gc.find(desk_id);
+      if (gc_it != m_desk_gc.end()) {
+        m_loop.cancel(gc_it->second);
+        m_desk_gc.erase(gc_it);
+      }
+
+      bool was_spare = *name == m_spare_desk;
+      m_tree.remove_desk(desk_id);
+      if (was_spare) {
+        m_spare_desk = find_spare_desk();
+      }
+
+    } else if (words[0] == "monitor_add" && count >= 3) {
+      m_tree.add_monitor(id_of_string(words[1]), std::string(words[2]));
+
+    } else if (words[0] == "monitor_rename" && count >= 4) {
+      m_tree.rename_monitor(id_of_string(words[1]), std::string(words[3]));
+
+    } else if (words[0] == "monitor_remove" && count >= 2) {
+      m_tree.remove_monitor(id_of_string(words[1]));
+      schedule_check(CHECK_SOON_MS);
+
+    } else if (words[0] == "monitor_swap" && count >= 3) {
+      m_tree.swap_monitors(id_of_string(words[1]), id_of_string(words[2]));
+
+    } else if (words[0] == "monitor_focus" && count >= 2) {
+      m_tree.focus_monitor(id_of_string(words[1]));
+    }
+  }
+};
+
+// A dapperc connection
+struct Client {
+  LineFramer in{256};
+  std::string out; // replies not sent yet
+  bool eof = false;
+};
+
+void append_reply(std::string &out, int status, const std::string &payload) {
+  out += std::to_string(status);
+  out += ' ';
+  out += std::to_string(payload.size());
+  out += '\n';
+  out += payload;
+}
+
+// Sends as much of the pending replies as the socket takes, returns false
+// if the client has gone away
+bool send_replies(int fd, Client &client) {
+  size_t sent = 0;
+  while (sent < client.out.size()) {
+    ssize_t n = send(fd, client.out.data() + sent, client.out.size() - sent, 0);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+
+  client.out.erase(0, sent);
+  return true;
+}
+
+// How long a client gets to finish up before a restart
+constexpr uint64_t FINISH_CLIENT_MS = 500;
+
+void usage() {
+  err("Usage: dapper [--record <log>]\n"
+      "       dapper --replay <log> [--max-speed]");
+}
+
+// The path this binary was started from. /proc/self/exe itself keeps
+// pointing at the old inode once an upgrade replaces the file, so restarts
+// exec the path instead.
+std::string exe_path() {
+  char path[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (len <= 0) {
+    return "/proc/self/exe";
+  }
+
+  std::string exe(path, static_cast<size_t>(len));
+  const std::string deleted = " (deleted)";
+  if (exe.size() > deleted.size() &&
+      exe.compare(exe.size() - deleted.size(), deleted.size(), deleted) == 0) {
+    exe.resize(exe.size() - deleted.size());
+  }
+  return exe;
+}
+
+// Hands over to a fresh copy of the binary at exe in this same process. The
+// listening socket and the bspwm subscription are inherited, and the state
+// (plus any half-read event line) goes along in a memfd. Only returns if
+// the exec failed.
+void restart(const std::string &exe, int sock_fd, int sub_fd,
+             const std::string &state) {
+  int state_fd = memfd_create("dapper-state", 0);
+  if (state_fd == -1) {
+    std::cerr << "Couldn't save the state for restarting" << std::endl;
+    return;
+  }
+  for (size_t off = 0; off < state.size();) {
+    ssize_t n = write(state_fd, state.data() + off, state.size() - off);
+    if (n <= 0) {
+      close(state_fd);
+      return;
+    }
+    off += static_cast<size_t>(n);
+  }
+  lseek(state_fd, 0, SEEK_SET);
+
+  fcntl(sock_fd, F_SETFD, 0);
+  fcntl(sub_fd, F_SETFD, 0);
+
+  auto fds = std::to_string(sock_fd) + "," + std::to_string(sub_fd) + "," +
+             std::to_string(state_fd);
+  const char *args[] = {"dapper", "--resume", fds.c_str(), nullptr};
+  execv(exe.c_str(), (char *const *) args);
+
+  std::cerr << "Couldn't restart: " << std::strerror(errno) << std::endl;
+  fcntl(sock_fd, F_SETFD, FD_CLOEXEC);
+  fcntl(sub_fd, F_SETFD, FD_CLOEXEC);
+  close(state_fd);
+}
+
+// Reads what restart() left behind
+std::string read_state(int state_fd) {
+  std::string state;
+  ssize_t n;
+  while ((n = read(state_fd, buffer, BUF_SIZE)) > 0) {
+    state.append(buffer, static_cast<size_t>(n));
+  }
+  close(state_fd);
+  return state;
+}
+
+// Feeds a recorded log back through Dapper, answering its bspwm requests
+// with the recorded replies and starting no processes, and reports how fast
+// the state machine got through it
+int replay(const std::string &path, bool max_speed) {
+  EventLog log;
+  if (!log.open_read(path.c_str())) {
+    err("Couldn't read a dapper log at: " + path);
+  }
+
+  std::vector<EventLog::Record> records;
+  std::deque<std::pair<std::string, std::string>> replies;
+  std::string config;
+  bool has_config = false;
+  EventLog::Record record;
+  while (log.read(record)) {
+    if (record.type == EventLog::CONFIG && !has_config) {
+      // What dapper started with, later ones are reloads
+      config = std::move(record.data);
+      has_config = true;
+    } else if (record.type == EventLog::REPLY) {
+      replies.emplace_back();
+      EventLog::split_reply(record.data, replies.back().first,
+                            replies.back().second);
+    } else {
+      records.push_back(std::move(record));
+    }
+  }
+
+  EventLoop loop;
+  Bspwm bspwm(std::move(replies));
+  Processes procs(true);
+
+  // Older logs don't have the config, so it has to come from disk
+  if (!has_config) {
+    std::cerr << "The log has no config, using " << config_path()
+              << std::endl;
+  }
+
+  uint64_t start = EventLoop::now();
+  Dapper dapper(bspwm, procs, loop, nullptr, has_config ? &config : nullptr);
+  uint64_t busy = EventLoop::now() - start;
+
+  LineFramer events;
+  size_t next = 0;
+  long lines = 0, commands = 0;
+
+  std::function<void()> step = [&] {
+    // Hand control back to the loop now and then so timers still run
+    constexpr int BATCH = 256;
+
+    for (int i = 0; i < BATCH && next < records.size(); i++) {
+      auto &rec = records[next];
+      uint64_t now = EventLoop::now();
+      if (!max_speed && start + rec.time > now) {
+        loop.defer((start + rec.time - now) / 1000000, step);
+        return;
+      }
+
+      if (rec.type == EventLog::EVENTS) {
+        events.feed(rec.data.data(), rec.data.size());
+        std::string_view line;
+        while (events.next(line)) {
+          dapper.handle_event(line);
+          lines++;
+        }
+      } else if (rec.type == EventLog::COMMAND) {
+        std::string reply;
+        dapper.handle_command(rec.data, reply);
+        commands++;
+      } else if (rec.type == EventLog::CONFIG) {
+        dapper.replay_config(rec.data);
+      }
+
+      busy += EventLoop::now() - now;
+      next++;
+    }
+
+    if (next < records.size()) {
+      loop.defer(0, step);
+    } else {
+      loop.stop();
+    }
+  };
+
+  loop.defer(0, step);
+  loop.run();
+
+  double seconds = static_cast<double>(busy) / 1e9;
+  std::cerr << "Replayed " << lines << " events and " << commands
+            << " commands in " << seconds * 1000 << "ms ("
+            << static_cast<long>(lines / std::max(seconds, 1e-9))
+            << " events/s), " << bspwm.replay_misses()
+            << " unmatched bspwm requests" << std::endl;
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  std::string exe = exe_path();
+  std::string record_path, replay_path;
+  bool max_speed = false;
+  int resume_fds[3] = {-1, -1, -1}; // listening socket, subscription, state
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--resume" && i + 1 < argc &&
+        std::sscanf(argv[++i], "%d,%d,%d", &resume_fds[0], &resume_fds[1],
+                    &resume_fds[2]) == 3) {
+      continue;
+    } else if (arg == "--record" && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (arg == "--replay" && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (arg == "--max-speed") {
+      max_speed = true;
+    } else {
+      usage();
+    }
+  }
+
+  if (!replay_path.empty()) {
+    return replay(replay_path, max_speed);
+  }
+
+  EventLog log;
+  if (!record_path.empty() && !log.open_write(record_path.c_str())) {
+    err("Couldn't write a log to: " + record_path);
+  }
+
+  // Subscribe to bspwm events over its socket
+
+  Bspwm bspwm;
+  if (!record_path.empty()) {
+    bspwm.record_to(&log);
+  }
+
+  // After a restart the subscription and socket are already there
+  bool resumed = resume_fds[0] != -1;
+  std::string state;
+  if (resumed) {
+    fcntl(resume_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(resume_fds[1], F_SETFD, FD_CLOEXEC);
+    state = read_state(resume_fds[2]);
+  }
+
+  std::vector<const char *> sub_args{"subscribe"};
+  sub_args.insert(sub_args.end(), std::begin(EVENT_NAMES),
+                  std::end(EVENT_NAMES));
+  sub_args.push_back(nullptr);
+  int pipe_read = resumed ? resume_fds[1] : bspwm.subscribe(sub_args.data());
+  if (pipe_read == -1) {
+    err("Failed to subscribe to bspwm events");
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // Create fd for dapper's communication socket
+
+  const char *sock_path = getenv(SOCKET_ENV);
+  if (!sock_path) {
+    sock_path = SOCKET_PATH;
+  }
+
+  int sock_fd = resume_fds[0];
+  if (!resumed) {
+    struct sockaddr_un sock_address = {};
+    sock_address.sun_family = AF_UNIX;
+    std::snprintf(sock_address.sun_path, sizeof(sock_address.sun_path), "%s",
+                  sock_path);
+
+    sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (sock_fd == -1) {
+      err("Couldn't create the socket");
+    }
+
+    unlink(sock_path);
+    if (bind(sock_fd, (struct sockaddr *) &sock_address,
+             sizeof(sock_address)) == -1) {
+      err("Couldn't bind a name to the socket");
+    }
+
+    if (listen(sock_fd, SOMAXCONN) == -1) {
+      err("Couldn't listen to the socket");
+    }
+  }
+
+  // Wire everything into the event loop
+
+  EventLoop loop;
+  Processes procs;
+
+  bool restarting = false;
+  for (int sig : {SIGINT, SIGHUP, SIGTERM}) {
+    loop.on_signal(sig, [&] { loop.stop(); });
+  }
+  loop.on_signal(SIGUSR2, [&] {
+    restarting = true;
+    loop.stop();
+  });
+  loop.on_signal(SIGCHLD, [&] { procs.reap(); });
+
+  // The state ends with the event line the last process was halfway through
+  std::string partial;
+  if (resumed) {
+    size_t partial_at = state.rfind("\npartial ");
+    if (partial_at != std::string::npos) {
+      partial = state.substr(partial_at + 9);
+      partial.pop_back(); // the newline
+      state.resize(partial_at + 1);
+    }
+  }
+
+  Dapper dapper(bspwm, procs, loop, resumed ? &state : nullptr);
+  dapper.watch_config();
+  if (!record_path.empty()) {
+    dapper.record_to(&log);
+  }
+
+  LineFramer events;
+  events.feed(partial.data(), partial.size());
+
+  loop.add(pipe_read, EPOLLIN, [&](uint32_t) {
+    ssize_t n = events.fill(pipe_read);
+    if (n > 0) {
+      if (!record_path.empty()) {
+        auto rest = events.rest();
+        log.write(EventLog::EVENTS, rest.data() + rest.size() - n,
+                  static_cast<size_t>(n));
+      }
+
+      std::string_view line;
+      while (events.next(line)) {
+        dapper.handle_event(line);
+      }
+    } else if (n == 0 || errno != EINTR) {
+      std::cerr << "Lost the bspwm subscription" << std::endl;
+      loop.stop();
+    }
+  });
+
+  // Clients can pipeline commands, replies are sent back as they're ready
+  std::unordered_map<int, std::unique_ptr<Client>> clients;
+
+  auto drop_client = [&](int cli_fd) {
+    loop.remove(cli_fd);
+    close(cli_fd);
+    clients.erase(cli_fd);
+  };
+
+  auto run_command = [&](Client &client, std::string_view command) {
+    if (!record_path.empty()) {
+      log.write(EventLog::COMMAND, command.data(), command.size());
+    }
+
+    // Restarting is up to the process, not the state machine
+    if (command == "restart") {
+      append_reply(client.out, 0, "");
+      restarting = true;
+      loop.stop();
+      return;
+    }
+
+    std::string reply;
+    int status = dapper.handle_command(command, reply);
+    append_reply(client.out, status, reply);
+  };
+
+  // Runs every complete command the client has sent, returns false if the
+  // connection broke
+  auto read_commands = [&](int cli_fd, Client &client) {
+    if (client.eof) {
+      return true;
+    }
+
+    ssize_t n;
+    std::string_view line;
+    while ((n = client.in.fill(cli_fd)) > 0) {
+      while (client.in.next(line)) {
+        run_command(client, line);
+      }
+    }
+
+    if (n == 0) {
+      client.eof = true;
+      if (!client.in.rest().empty()) {
+        run_command(client, client.in.rest());
+      }
+      return true;
+    }
+    return errno == EAGAIN || errno == EINTR;
+  };
+
+  // Before a restart: answers whatever the client sent that the loop didn't
+  // get to, giving a line that's halfway there and the replies a moment to
+  // go through
+  auto finish_client = [&](int cli_fd, Client &client) {
+    uint64_t deadline = EventLoop::now() + FINISH_CLIENT_MS * 1000000;
+    while (read_commands(cli_fd, client) && send_replies(cli_fd, client)) {
+      bool partial = !client.eof && !client.in.rest().empty();
+      uint64_t now = EventLoop::now();
+      if ((client.out.empty() && !partial) || now >= deadline) {
+        return;
+      }
+
+      struct pollfd pfd = {cli_fd, 0, 0};
+      pfd.events = static_cast<short>((partial ? POLLIN : 0) |
+                                      (client.out.empty() ? 0 : POLLOUT));
+      poll(&pfd, 1, static_cast<int>((deadline - now) / 1000000) + 1);
+    }
+  };
+
+  loop.add(sock_fd, EPOLLIN, [&](uint32_t) {
+    int cli_fd;
+    while ((cli_fd = accept4(sock_fd, nullptr, nullptr,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+      clients[cli_fd] = std::make_unique<Client>();
+
+      loop.add(cli_fd, EPOLLIN, [&, cli_fd](uint32_t) {
+        auto &client = *clients[cli_fd];
+
+        if (!read_commands(cli_fd, client)) {
+          drop_client(cli_fd);
+          return;
+        }
+
+        if (!send_replies(cli_fd, client) ||
+            (client.eof && client.out.empty())) {
+          drop_client(cli_fd);
+          return;
+        }
+
+        // Once the client is done sending, only wait to finish replying
+        uint32_t events = client.eof ? 0 : EPOLLIN;
+        loop.modify(cli_fd, client.out.empty() ? events : events | EPOLLOUT);
+      });
+    }
+  });
+
+  while (true) {
+    loop.run();
+    if (!restarting) {
+      break;
+    }
+
+    // Connected clients are answered first, new ones wait in the listen
+    // backlog for the next process
+    for (auto &client : clients) {
+      finish_client(client.first, *client.second);
+      close(client.first);
+    }
+    clients.clear();
+
+    // The log ends here, the next process doesn't record
+    log.flush();
+
+    auto rest = events.rest();
+    restart(exe, sock_fd, pipe_read,
+            dapper.save_state() + "partial " + std::string(rest) + "\n");
+    restarting = false;
+  }
+
+  for (auto &client : clients) {
+    close(client.first);
+  }
+  clients.clear();
   close(sock_fd);
-  unlink(SOCKET_PATH);
+  unlink(sock_path);
   close(pipe_read);
 }
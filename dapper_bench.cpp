@@ -0,0 +1,861 @@
+// End-to-end latency benchmark. Runs dapper against a fake bspwm that keeps
+// its tree in memory, so it works on a headless box without X.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+constexpr size_t BUF_SIZE = 10240;
+
+void err(const std::string& msg) {
+  std::cerr << msg << std::endl;
+  std::exit(1);
+}
+
+int listen_unix(const std::string &path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::snprintf(address.sun_path, sizeof(address.sun_path), "%s",
+                path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(path.c_str());
+  if (fd == -1 ||
+      bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+      listen(fd, SOMAXCONN) == -1) {
+    err("Couldn't listen on " + path);
+  }
+  return fd;
+}
+
+int connect_unix(const std::string &path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  std::snprintf(address.sun_path, sizeof(address.sun_path), "%s",
+                path.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd != -1 &&
+      connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool send_all(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+std::string hex_id(unsigned int id) {
+  char str[16];
+  std::snprintf(str, sizeof(str), "0x%08X", id);
+  return str;
+}
+
+// Stands in for bspwm: answers the messages dapper sends over the bspwm
+// socket from an in-memory tree and emits events to subscribers
+
+class FakeBspwm {
+private:
+  struct Desktop {
+    unsigned int id;
+    std::string name;
+    std::vector<unsigned int> nodes; // leaves in order
+  };
+
+  struct Subscriber {
+    int fd;
+    std::vector<std::string> events;
+  };
+
+  static constexpr unsigned int MONITOR_ID = 0x00200001;
+
+  std::string m_path;
+  int m_listen_fd;
+  int m_wake[2];
+  std::thread m_thread;
+
+  std::mutex m_mutex;
+  std::condition_variable m_moved;
+  std::vector<Desktop> m_desks;
+  std::unordered_map<unsigned int, std::string> m_classes; // node -> class
+  unsigned int m_focused = 0;
+  unsigned int m_next_desk = 0x00200002;
+  unsigned int m_next_node = 0x00400001;
+  std::vector<Subscriber> m_subscribers;
+  std::unordered_map<unsigned int, Clock::time_point> m_moves; // node -> when
+  std::atomic<long> m_requests{0};
+
+  Desktop *find_desk(const std::string &sel) {
+    if (sel == "focused") {
+      return find_desk_id(m_focused);
+    }
+
+    char *end;
+    unsigned long id = std::strtoul(sel.c_str(), &end, 0);
+    if (*end == '\0' && !sel.empty()) {
+      return find_desk_id(static_cast<unsigned int>(id));
+    }
+
+    for (auto &desk : m_desks) {
+      if (desk.name == sel) {
+        return &desk;
+      }
+    }
+    return nullptr;
+  }
+
+  Desktop *find_desk_id(unsigned int id) {
+    for (auto &desk : m_desks) {
+      if (desk.id == id) {
+        return &desk;
+      }
+    }
+    return nullptr;
+  }
+
+  Desktop *desk_of_node(unsigned int node) {
+    for (auto &desk : m_desks) {
+      if (std::find(desk.nodes.begin(), desk.nodes.end(), node) !=
+          desk.nodes.end()) {
+        return &desk;
+      }
+    }
+    return nullptr;
+  }
+
+  static bool wants(const Subscriber &sub, const std::string &event) {
+    if (sub.events.empty()) {
+      return true;
+    }
+
+    for (auto &name : sub.events) {
+      if (name == "all" || name == event ||
+          event.compare(0, name.size() + 1, name + "_") == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void emit(const std::string &event, const std::string &args) {
+    std::string line = event + " " + args + "\n";
+    for (auto &sub : m_subscribers) {
+      if (wants(sub, event)) {
+        send_all(sub.fd, line);
+      }
+    }
+  }
+
+  void node_json(std::string &out, unsigned int id) {
+    out += "{\"id\":" + std::to_string(id) +
+           ",\"splitType\":\"vertical\",\"splitRatio\":0.5,\"vacant\":false,"
+           "\"hidden\":false,\"sticky\":false,\"private\":false,"
+           "\"locked\":false,\"marked\":false,\"presel\":null,"
+           "\"rectangle\":{\"x\":0,\"y\":0,\"width\":1920,\"height\":1080},"
+           "\"constraints\":{\"min_width\":32,\"min_height\":32},"
+           "\"firstChild\":null,\"secondChild\":null,\"client\":{"
+           "\"className\":\"" + m_classes[id] + "\",\"instanceName\":\"" +
+           m_classes[id] + "\",\"borderWidth\":1,\"state\":\"tiled\","
+           "\"lastState\":\"tiled\",\"layer\":\"normal\","
+           "\"lastLayer\":\"normal\",\"urgent\":false,\"shown\":true,"
+           "\"tiledRectangle\":{\"x\":0,\"y\":0,\"width\":1920,\"height\":1080},"
+           "\"floatingRectangle\":{\"x\":0,\"y\":0,\"width\":640,\"height\":480}"
+           "}}";
+  }
+
+  // Leaves hang off a chain of internal nodes, like repeated splits would
+  void subtree_json(std::string &out, const std::vector<unsigned int> &nodes,
+                    size_t first, unsigned int &internal_id) {
+    if (first + 1 == nodes.size()) {
+      node_json(out, nodes[first]);
+      return;
+    }
+
+    out += "{\"id\":" + std::to_string(internal_id++) +
+           ",\"splitType\":\"vertical\",\"splitRatio\":0.5,\"presel\":null,"
+           "\"rectangle\":{\"x\":0,\"y\":0,\"width\":1920,\"height\":1080},"
+           "\"firstChild\":";
+    node_json(out, nodes[first]);
+    out += ",\"secondChild\":";
+    subtree_json(out, nodes, first + 1, internal_id);
+    out += ",\"client\":null}";
+  }
+
+  void monitor_json(std::string &out) {
+    unsigned int internal_id = 0x00F00001;
+
+    out += "{\"name\":\"FAKE-1\",\"id\":" + std::to_string(MONITOR_ID) +
+           ",\"randrId\":1,\"wired\":true,\"stickyCount\":0,"
+           "\"windowGap\":6,\"borderWidth\":1,\"focusedDesktopId\":" +
+           std::to_string(m_focused) +
+           ",\"padding\":{\"top\":0,\"right\":0,\"bottom\":0,\"left\":0},"
+           "\"rectangle\":{\"x\":0,\"y\":0,\"width\":1920,\"height\":1080},"
+           "\"desktops\":[";
+    for (size_t i = 0; i < m_desks.size(); i++) {
+      auto &desk = m_desks[i];
+      out += i ? "," : "";
+      out += "{\"name\":\"" + desk.name + "\",\"id\":" +
+             std::to_string(desk.id) +
+             ",\"layout\":\"tiled\",\"userLayout\":\"tiled\",\"windowGap\":6,"
+             "\"borderWidth\":1,\"focusedNodeId\":0,"
+             "\"padding\":{\"top\":0,\"right\":0,\"bottom\":0,\"left\":0},"
+             "\"root\":";
+      if (desk.nodes.empty()) {
+        out += "null";
+      } else {
+        subtree_json(out, desk.nodes, 0, internal_id);
+      }
+      out += "}";
+    }
+    out += "]}";
+  }
+
+  void fail(std::string &rsp, const std::string &msg) {
+    rsp = "\x07" + msg + "\n";
+  }
+
+  // Returns false if the connection is kept open as a subscription
+  bool handle(int fd, const std::vector<std::string> &args, std::string &rsp) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_requests++;
+
+    auto has = [&](const char *flag) {
+      return std::find(args.begin(), args.end(), flag) != args.end();
+    };
+
+    if (args.empty()) {
+      fail(rsp, "No arguments given.");
+
+    } else if (args[0] == "subscribe") {
+      m_subscribers.push_back({fd, {args.begin() + 1, args.end()}});
+      return false;
+
+    } else if (args[0] == "query" && has("-T") && has("-m")) {
+      monitor_json(rsp);
+
+    } else if (args[0] == "wm" && has("-d")) {
+      rsp = "{\"focusedMonitorId\":" + std::to_string(MONITOR_ID) +
+            ",\"primaryMonitorId\":" + std::to_string(MONITOR_ID) +
+            ",\"clientsCount\":" + std::to_string(m_classes.size()) +
+            ",\"monitors\":[";
+      monitor_json(rsp);
+      rsp += "],\"focusHistory\":[],\"stackingList\":[]}";
+
+    } else if (args[0] == "query" && has("-T") && args.size() > 2 &&
+               args[1] == "-n") {
+      auto id = static_cast<unsigned int>(std::strtoul(args[2].c_str(),
+                                                       nullptr, 0));
+      if (m_classes.count(id)) {
+        node_json(rsp, id);
+      } else {
+        fail(rsp, "query -n: Invalid descriptor found in '" + args[2] + "'.");
+      }
+
+    } else if (args[0] == "query" && args.size() > 2 && args[1] == "-d") {
+      auto desk = find_desk(args[2]);
+      if (!desk) {
+        fail(rsp, "query -d: Invalid descriptor found in '" + args[2] + "'.");
+      } else {
+        rsp = has("--names") ? desk->name + "\n" : hex_id(desk->id) + "\n";
+      }
+
+    } else if (args[0] == "monitor" && has("--add-desktops")) {
+      for (size_t i = 2; i < args.size(); i++) {
+        m_desks.push_back({m_next_desk++, args[i], {}});
+        emit("desktop_add", hex_id(MONITOR_ID) + " " +
+                                hex_id(m_desks.back().id) + " " + args[i]);
+      }
+
+    } else if (args[0] == "desktop" && args.size() > 2) {
+      auto desk = find_desk(args[1]);
+      if (!desk) {
+        fail(rsp, "desktop: Invalid descriptor found in '" + args[1] + "'.");
+      } else if (args[2] == "--focus") {
+        m_focused = desk->id;
+        emit("desktop_focus", hex_id(MONITOR_ID) + " " + hex_id(desk->id));
+      } else if (args[2] == "--remove") {
+        unsigned int id = desk->id;
+        m_desks.erase(m_desks.begin() + (desk - m_desks.data()));
+        emit("desktop_remove", hex_id(MONITOR_ID) + " " + hex_id(id));
+      }
+
+    } else if (args[0] == "node" && args.size() > 3 &&
+               args[2] == "--to-desktop") {
+      auto id = static_cast<unsigned int>(std::strtoul(args[1].c_str(),
+                                                       nullptr, 0));
+      auto src = desk_of_node(id);
+      auto dst = find_desk(args[3]);
+      if (!src || !dst) {
+        fail(rsp, "node: Invalid descriptor.");
+      } else if (src != dst) {
+        src->nodes.erase(std::find(src->nodes.begin(), src->nodes.end(), id));
+        dst->nodes.push_back(id);
+        emit("node_transfer",
+             hex_id(MONITOR_ID) + " " + hex_id(src->id) + " " + hex_id(id) +
+                 " " + hex_id(MONITOR_ID) + " " + hex_id(dst->id) + " " +
+                 hex_id(dst->nodes.size() > 1 ? dst->nodes.front() : 0));
+      }
+      m_moves[id] = Clock::now();
+      m_moved.notify_all();
+
+    } else {
+      fail(rsp, "Unknown command: " + args[0]);
+    }
+
+    return true;
+  }
+
+  void serve() {
+    std::vector<char> buf(BUF_SIZE);
+
+    while (true) {
+      struct pollfd fds[] = {{m_listen_fd, POLLIN, 0},
+                             {m_wake[0], POLLIN, 0}};
+      if (poll(fds, 2, -1) == -1 || fds[1].revents) {
+        return;
+      }
+
+      int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd == -1) {
+        continue;
+      }
+
+      // Messages are small and sent in one go, like bspc does
+      ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+      std::vector<std::string> args;
+      for (ssize_t start = 0, i = 0; i < n; i++) {
+        if (buf[static_cast<size_t>(i)] == '\0') {
+          args.emplace_back(buf.data() + start, buf.data() + i);
+          start = i + 1;
+        }
+      }
+
+      std::string rsp;
+      if (handle(fd, args, rsp)) {
+        send_all(fd, rsp);
+        close(fd);
+      }
+    }
+  }
+
+public:
+  explicit FakeBspwm(const std::string &path) : m_path(path) {
+    m_listen_fd = listen_unix(path);
+    if (pipe2(m_wake, O_CLOEXEC) == -1) {
+      err("Failed to create pipe");
+    }
+  }
+
+  ~FakeBspwm() {
+    stop();
+    for (auto &sub : m_subscribers) {
+      close(sub.fd);
+    }
+    close(m_listen_fd);
+    close(m_wake[0]);
+    close(m_wake[1]);
+    unlink(m_path.c_str());
+  }
+
+  void start() {
+    m_thread = std::thread([this] { serve(); });
+  }
+
+  void stop() {
+    if (m_thread.joinable()) {
+      write(m_wake[1], "", 1);
+      m_thread.join();
+    }
+  }
+
+  unsigned int add_desk(const std::string &name) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_desks.push_back({m_next_desk++, name, {}});
+    if (!m_focused) {
+      m_focused = m_desks.back().id;
+    }
+    return m_desks.back().id;
+  }
+
+  // The id of a desktop by name or id, 0 if there's no such desktop
+  unsigned int desk_id(const std::string &sel) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto desk = find_desk(sel);
+    return desk ? desk->id : 0;
+  }
+
+  // Maps a window and tells subscribers, like a client showing up would
+  unsigned int add_window(const std::string &cls, unsigned int desk_id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto desk = find_desk_id(desk_id);
+    unsigned int id = m_next_node++;
+    unsigned int ip = desk->nodes.empty() ? 0 : desk->nodes.back();
+
+    desk->nodes.push_back(id);
+    m_classes[id] = cls;
+    m_moves.erase(id);
+    emit("node_add", hex_id(MONITOR_ID) + " " + hex_id(desk_id) + " " +
+                         hex_id(ip) + " " + hex_id(id));
+    return id;
+  }
+
+  void remove_window(unsigned int id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto desk = desk_of_node(id);
+    if (!desk) {
+      return;
+    }
+
+    desk->nodes.erase(std::find(desk->nodes.begin(), desk->nodes.end(), id));
+    m_classes.erase(id);
+    emit("node_remove",
+         hex_id(MONITOR_ID) + " " + hex_id(desk->id) + " " + hex_id(id));
+  }
+
+  // Waits until the node gets moved, returns when it happened
+  bool wait_for_move(unsigned int id, Clock::time_point &when) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    bool moved = m_moved.wait_for(lock, std::chrono::seconds(2), [&] {
+      return m_moves.count(id) > 0;
+    });
+    if (moved) {
+      when = m_moves[id];
+    }
+    return moved;
+  }
+
+  long requests() const { return m_requests; }
+};
+
+// Talks the dapperc protocol over one persistent connection
+
+class DapperClient {
+private:
+  int m_fd;
+  std::string m_in;
+  char m_buf[BUF_SIZE];
+
+public:
+  explicit DapperClient(int fd) : m_fd(fd) {}
+  ~DapperClient() { close(m_fd); }
+
+  // Sends a command and waits for its reply, returns the reply's status
+  int command(const std::string &cmd) {
+    if (!send_all(m_fd, cmd + "\n")) {
+      err("Lost the connection to dapper");
+    }
+
+    while (true) {
+      size_t newline = m_in.find('\n');
+      int status;
+      size_t len;
+      if (newline != std::string::npos &&
+          std::sscanf(m_in.c_str(), "%d %zu", &status, &len) == 2 &&
+          m_in.size() - newline - 1 >= len) {
+        m_in.erase(0, newline + 1 + len);
+        return status;
+      }
+
+      ssize_t n = recv(m_fd, m_buf, sizeof(m_buf), 0);
+      if (n <= 0) {
+        err("Lost the connection to dapper");
+      }
+      m_in.append(m_buf, static_cast<size_t>(n));
+    }
+  }
+};
+
+struct Samples {
+  std::string name;
+  std::vector<double> us;
+
+  void add(Clock::duration d) {
+    us.push_back(std::chrono::duration<double, std::micro>(d).count());
+  }
+
+  void report() {
+    if (us.empty()) {
+      std::printf("%-14s no samples\n", name.c_str());
+      return;
+    }
+
+    std::sort(us.begin(), us.end());
+    auto pct = [&](double p) {
+      return us[std::min(us.size() - 1, static_cast<size_t>(p * us.size()))];
+    };
+    double sum = 0;
+    for (double v : us) {
+      sum += v;
+    }
+
+    std::printf("%-14s n=%-6zu p50=%9.1fus p99=%9.1fus mean=%9.1fus "
+                "max=%9.1fus\n",
+                name.c_str(), us.size(), pct(0.5), pct(0.99),
+                sum / us.size(), us.back());
+  }
+};
+
+static const char *CONFIG = R"({
+  "apps": {
+    "term": {"commands": ["alacritty"], "classes": ["Alacritty"]},
+    "web": {"commands": ["firefox"], "classes": ["Firefox"]},
+    "code": {"commands": ["code -n", "clion"], "classes": ["Code"]},
+    "music": {"commands": ["spotify"], "classes": ["", "Spotify"]}
+  },
+
+  "launcher": "rofi -dmenu"
+}
+)";
+
+// A workload is a script with one step per line, anything from a # on is a
+// comment:
+//
+//   desk <name>                  adds a desktop, before start only
+//   window <class> <desk>        maps a window
+//   start                        starts dapper, timed as "startup"
+//   command <label> <command>    sends a dapperc command, timed under label
+//                                ("-" for untimed)
+//   move <label> <class> <desk>  maps a window, times how long until dapper
+//                                moves it and unmaps it again
+//   repeat <n> ... end           runs the steps in between n times
+typedef std::vector<std::string> Step;
+
+// What runs without a script: a session that's been in use for a while,
+// then focusing (alternating between two apps so windows actually move),
+// pulling, and a non-app window showing up on an app desktop
+std::string default_script(int iterations, int app_windows) {
+  const char *desks[] = {"I", "II", "III", "IV"};
+  std::string script;
+  for (auto desk : desks) {
+    script += std::string("desk ") + desk + "\n";
+  }
+  for (int i = 0; i < app_windows; i++) {
+    script += std::string("window Alacritty ") + desks[i % 4] + "\n";
+    script += std::string("window Firefox ") + desks[(i + 1) % 4] + "\n";
+  }
+  for (int i = 0; i < 4 * app_windows; i++) {
+    script += "window Misc" + std::to_string(i % 7) + " " + desks[i % 4] +
+              "\n";
+  }
+
+  std::string n = std::to_string(iterations);
+  script += "start\n"
+            "command - term\n"
+            "repeat " + std::to_string(iterations / 2) + "\n"
+            "command app_focus web\n"
+            "command app_focus term\n"
+            "end\n";
+  if (iterations % 2) {
+    script += "command app_focus web\n";
+  }
+  script += "repeat " + n + "\n"
+            "command - web\n"
+            "command app_pull term --pull\n"
+            "end\n"
+            "command - term\n"
+            "repeat " + n + "\n"
+            "move window_add Scratch term\n"
+            "end\n";
+  return script;
+}
+
+// Splits a script into steps and checks it all makes sense before anything
+// is started
+std::vector<Step> parse_script(const std::string &script) {
+  std::vector<Step> steps;
+  std::istringstream lines(script);
+  std::string line;
+  int line_no = 0, depth = 0;
+  bool started = false;
+
+  while (std::getline(lines, line)) {
+    line_no++;
+    std::istringstream words(line);
+    Step step;
+    std::string word;
+    while (words >> word && word[0] != '#') {
+      step.push_back(word);
+    }
+    if (step.empty()) {
+      continue;
+    }
+
+    auto &cmd = step[0];
+    size_t n = step.size();
+    bool ok = (cmd == "desk" && n == 2 && !started) ||
+              (cmd == "window" && n == 3) ||
+              (cmd == "start" && n == 1 && !started && depth == 0) ||
+              (cmd == "command" && n >= 3 && started) ||
+              (cmd == "move" && n == 4 && started) ||
+              (cmd == "repeat" && n == 2 &&
+               step[1].find_first_not_of("0123456789") == std::string::npos) ||
+              (cmd == "end" && n == 1 && depth > 0);
+    if (!ok) {
+      err("Bad workload step on line " + std::to_string(line_no) + ": " +
+          line);
+    }
+
+    started |= cmd == "start";
+    depth += cmd == "repeat" ? 1 : cmd == "end" ? -1 : 0;
+    steps.push_back(std::move(step));
+  }
+
+  if (depth > 0) {
+    err("Bad workload: repeat without end");
+  }
+  return steps;
+}
+
+// Where the repeat at steps[i] ends
+size_t matching_end(const std::vector<Step> &steps, size_t i) {
+  int depth = 0;
+  for (i++; i < steps.size(); i++) {
+    if (steps[i][0] == "repeat") {
+      depth++;
+    } else if (steps[i][0] == "end" && depth-- == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+// Runs a script from parse_script() against fake bspwm and the dapper
+// binary at dapper_path
+class Workload {
+private:
+  FakeBspwm &m_bspwm;
+  std::string m_dapper_path;
+  std::string m_dapper_sock;
+  pid_t m_pid = -1;
+  std::unique_ptr<DapperClient> m_dapper;
+  std::vector<Samples> m_samples; // in the order labels first show up
+
+  Samples &samples(const std::string &label) {
+    for (auto &s : m_samples) {
+      if (s.name == label) {
+        return s;
+      }
+    }
+    m_samples.push_back({label, {}});
+    return m_samples.back();
+  }
+
+  // Gives up without leaving dapper running
+  void fail(const std::string &msg) {
+    if (m_pid != -1) {
+      kill(m_pid, SIGTERM);
+      waitpid(m_pid, nullptr, 0);
+    }
+    err(msg);
+  }
+
+  unsigned int desk_id(const std::string &name) {
+    unsigned int id = m_bspwm.desk_id(name);
+    if (!id) {
+      fail("No desktop named " + name);
+    }
+    return id;
+  }
+
+  void start() {
+    auto start_time = Clock::now();
+    m_bspwm.start();
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    const char *dapper_argv[] = {m_dapper_path.c_str(), nullptr};
+    if (posix_spawn(&m_pid, m_dapper_path.c_str(), &actions, nullptr,
+                    (char *const *) dapper_argv, environ) != 0) {
+      m_pid = -1;
+      fail("Couldn't start " + m_dapper_path);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+
+    // It's done bootstrapping once it answers a command
+    int fd;
+    while ((fd = connect_unix(m_dapper_sock)) == -1) {
+      if (waitpid(m_pid, nullptr, WNOHANG) == m_pid) {
+        m_pid = -1;
+        fail("dapper exited during startup");
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    m_dapper.reset(new DapperClient(fd));
+    m_dapper->command("stats");
+    samples("startup").add(Clock::now() - start_time);
+  }
+
+  void run_step(const Step &step) {
+    auto &cmd = step[0];
+    if (cmd == "desk") {
+      m_bspwm.add_desk(step[1]);
+
+    } else if (cmd == "window") {
+      m_bspwm.add_window(step[1], desk_id(step[2]));
+
+    } else if (cmd == "start") {
+      start();
+
+    } else if (cmd == "command") {
+      std::string command = step[2];
+      for (size_t i = 3; i < step.size(); i++) {
+        command += " " + step[i];
+      }
+      auto t = Clock::now();
+      m_dapper->command(command);
+      if (step[1] != "-") {
+        samples(step[1]).add(Clock::now() - t);
+      }
+
+    } else if (cmd == "move") {
+      auto t = Clock::now();
+      unsigned int id = m_bspwm.add_window(step[2], desk_id(step[3]));
+      Clock::time_point moved;
+      if (m_bspwm.wait_for_move(id, moved)) {
+        samples(step[1]).add(moved - t);
+      }
+      m_bspwm.remove_window(id);
+    }
+  }
+
+public:
+  Workload(FakeBspwm &bspwm, const std::string &dapper_path,
+           const std::string &dapper_sock)
+      : m_bspwm(bspwm), m_dapper_path(dapper_path),
+        m_dapper_sock(dapper_sock) {}
+
+  ~Workload() {
+    m_dapper.reset();
+    if (m_pid != -1) {
+      kill(m_pid, SIGTERM);
+      waitpid(m_pid, nullptr, 0);
+    }
+    m_bspwm.stop();
+  }
+
+  // Runs steps [begin, end)
+  void run(const std::vector<Step> &steps, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+      if (steps[i][0] != "repeat") {
+        run_step(steps[i]);
+        continue;
+      }
+
+      size_t body_end = matching_end(steps, i);
+      for (long n = std::atol(steps[i][1].c_str()); n > 0; n--) {
+        run(steps, i + 1, body_end);
+      }
+      i = body_end;
+    }
+  }
+
+  void report() {
+    for (auto &s : m_samples) {
+      s.report();
+    }
+  }
+};
+
+void usage() {
+  err("Usage: dapper_bench <path to dapper> [iterations] [windows per app]\n"
+      "       dapper_bench <path to dapper> --script <workload>");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+  }
+
+  std::string dapper_path = argv[1];
+  std::string script, title;
+  if (argc == 4 && std::strcmp(argv[2], "--script") == 0) {
+    std::ifstream file(argv[3]);
+    if (!file) {
+      err(std::string("Couldn't read ") + argv[3]);
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    script = contents.str();
+    title = argv[3];
+  } else {
+    int iterations = argc > 2 ? std::atoi(argv[2]) : 500;
+    int app_windows = argc > 3 ? std::atoi(argv[3]) : 12;
+    if (iterations <= 0 || app_windows <= 0) {
+      usage();
+    }
+    script = default_script(iterations, app_windows);
+    title = std::to_string(app_windows) + " windows per app, " +
+            std::to_string(iterations) + " iterations";
+  }
+  auto steps = parse_script(script);
+
+  // Everything dapper touches lives in a scratch directory
+
+  char dir_tpl[] = "/tmp/dapper-bench-XXXXXX";
+  if (!mkdtemp(dir_tpl)) {
+    err("Couldn't create a scratch directory");
+  }
+  std::string dir = dir_tpl;
+  std::string bspwm_path = dir + "/bspwm.socket";
+  std::string dapper_sock = dir + "/dapper.socket";
+
+  mkdir((dir + "/.config").c_str(), 0700);
+  mkdir((dir + "/.config/dapper").c_str(), 0700);
+  std::ofstream(dir + "/.config/dapper/config.json") << CONFIG;
+
+  setenv("HOME", dir.c_str(), 1);
+  setenv("BSPWM_SOCKET", bspwm_path.c_str(), 1);
+  setenv("DAPPER_SOCKET", dapper_sock.c_str(), 1);
+  setenv("SHELL", "/bin/true", 1); // app launches do nothing
+  signal(SIGPIPE, SIG_IGN);
+
+  {
+    FakeBspwm bspwm(bspwm_path);
+    Workload workload(bspwm, dapper_path, dapper_sock);
+    workload.run(steps, 0, steps.size());
+    std::printf("%s, %ld bspwm requests\n", title.c_str(),
+                bspwm.requests());
+    workload.report();
+  }
+
+  unlink((dir + "/.config/dapper/config.json").c_str());
+  rmdir((dir + "/.config/dapper").c_str());
+  rmdir((dir + "/.config").c_str());
+  rmdir(dir.c_str());
+}
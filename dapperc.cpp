@@ -1,24 +1,89 @@
 // Sockets code largely stolen from bspwm
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <poll.h>
+#include <string>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 static const char *SOCKET_PATH = "/tmp/dapper.socket";
+static const char *SOCKET_ENV = "DAPPER_SOCKET";
+
+constexpr size_t BUF_SIZE = 10240;
+char buffer[BUF_SIZE];
 
 void err(const std::string& msg) {
   std::cerr << msg << std::endl;
   std::exit(1);
 }
 
+void usage() {
+  err("Usage: dapperc <command>...\n"
+      "       dapperc -    (one command per line on stdin)");
+}
+
+bool send_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, 0);
+    if (n == -1) {
+      return false;
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// Replies are "<status> <payload length>\n<payload>". Prints every complete
+// reply in `in` and drops it, returns how many there were.
+int print_replies(std::string &in, int &status) {
+  int count = 0;
+  size_t start = 0;
+
+  while (true) {
+    size_t newline = in.find('\n', start);
+    if (newline == std::string::npos) {
+      break;
+    }
+
+    int reply_status;
+    size_t len;
+    if (std::sscanf(in.c_str() + start, "%d %zu", &reply_status, &len) != 2) {
+      err("Malformed reply from dapper");
+    }
+    if (in.size() - newline - 1 < len) {
+      break;
+    }
+
+    if (len > 0) {
+      auto &out = reply_status == 0 ? std::cout : std::cerr;
+      out.write(in.data() + newline + 1, static_cast<std::streamsize>(len));
+      if (in[newline + len] != '\n') {
+        out << '\n';
+      }
+    }
+
+    status = status == 0 ? reply_status : status;
+    start = newline + 1 + len;
+    count++;
+  }
+
+  in.erase(0, start);
+  std::cout.flush();
+  return count;
+}
+
 int main(int argc, char *argv[]) {
   if (argc < 2) {
-    err("No arguments given");
+    usage();
   }
 
+  bool from_stdin = argc == 2 && std::strcmp(argv[1], "-") == 0;
+
   struct sockaddr_un sock_address = {};
   sock_address.sun_family = AF_UNIX;
 
@@ -27,17 +92,83 @@ int main(int argc, char *argv[]) {
     err("Failed to create the dapper socket");
   }
 
+  const char *sock_path = getenv(SOCKET_ENV);
   std::snprintf(sock_address.sun_path, sizeof(sock_address.sun_path), "%s",
-                SOCKET_PATH);
+                sock_path ? sock_path : SOCKET_PATH);
 
   if (connect(sock_fd, (struct sockaddr *)&sock_address,
               sizeof(sock_address)) == -1) {
     err("Failed to connect to the dapper socket");
   }
 
-  if (send(sock_fd, argv[1], strlen(argv[1]), 0) == -1) {
-    err("Failed to send the data");
+  std::string replies;
+  int status = 0;
+
+  if (!from_stdin) {
+    // The arguments make up a single command
+    std::string command;
+    for (int i = 1; i < argc; i++) {
+      command += i > 1 ? " " : "";
+      command += argv[i];
+    }
+    command += '\n';
+
+    if (!send_all(sock_fd, command.data(), command.size())) {
+      err("Failed to send the data");
+    }
+
+    ssize_t n;
+    while (print_replies(replies, status) == 0) {
+      if ((n = recv(sock_fd, buffer, BUF_SIZE, 0)) <= 0) {
+        err("dapper closed the connection without replying");
+      }
+      replies.append(buffer, static_cast<size_t>(n));
+    }
+
+    close(sock_fd);
+    return status;
+  }
+
+  // Keep one connection open and pipeline whatever comes in on stdin,
+  // printing replies as they arrive
+  long pending = 0;
+  bool stdin_open = true;
+  char last = '\n';
+
+  while (stdin_open || pending > 0) {
+    struct pollfd fds[] = {{sock_fd, POLLIN, 0},
+                           {STDIN_FILENO, POLLIN, 0}};
+    if (poll(fds, stdin_open ? 2 : 1, -1) == -1) {
+      err("Failed to poll");
+    }
+
+    if (stdin_open && fds[1].revents) {
+      ssize_t n = read(STDIN_FILENO, buffer, BUF_SIZE);
+      if (n > 0) {
+        size_t len = static_cast<size_t>(n);
+        pending += std::count(buffer, buffer + len, '\n');
+        last = buffer[len - 1];
+        if (!send_all(sock_fd, buffer, len)) {
+          err("Failed to send the data");
+        }
+      } else {
+        // An unterminated last line still counts as a command
+        pending += last != '\n';
+        stdin_open = false;
+        shutdown(sock_fd, SHUT_WR);
+      }
+    }
+
+    if (fds[0].revents) {
+      ssize_t n = recv(sock_fd, buffer, BUF_SIZE, 0);
+      if (n <= 0) {
+        err("dapper closed the connection before answering everything");
+      }
+      replies.append(buffer, static_cast<size_t>(n));
+      pending -= print_replies(replies, status);
+    }
   }
 
   close(sock_fd);
+  return status;
 }